@@ -0,0 +1,79 @@
+#include "arena.h"
+#include "thread.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN 16
+
+// The first chunk is the one allocations are bumped from. Allocations too
+// big to share a chunk get their own, behind it, so its free space isn't lost.
+struct arena_chunk {
+  arena_chunk_t* next;
+  size_t size;
+};
+
+// The memory of a chunk starts after its header, aligned like everything it hands out
+#define ARENA_HEADER_SIZE ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(chunk) ((char*)(chunk) + ARENA_HEADER_SIZE)
+
+static thread_atomic_int_t g_total_reserved;
+
+static arena_chunk_t* add_chunk(arena_t* arena, size_t size, bool current)
+{
+  arena_chunk_t* chunk = calloc(1, ARENA_HEADER_SIZE + size);
+  if (chunk == NULL) {
+    perror("Failed to grow arena");
+    exit(EXIT_FAILURE);
+  }
+  chunk->size = size;
+
+  if (current || arena->chunks == NULL) {
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->used = 0;
+  } else {
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+  }
+  arena->reserved += ARENA_HEADER_SIZE + size;
+  thread_atomic_int_add(&g_total_reserved, (int)(ARENA_HEADER_SIZE + size));
+  return chunk;
+}
+
+void* arena_alloc(arena_t* arena, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (size > ARENA_CHUNK_SIZE / 4) {
+    bool current = arena->chunks == NULL;
+    arena_chunk_t* chunk = add_chunk(arena, size, false);
+    if (current) arena->used = size;
+    return CHUNK_DATA(chunk);
+  }
+
+  if (arena->chunks == NULL || arena->used + size > arena->chunks->size) {
+    add_chunk(arena, ARENA_CHUNK_SIZE, true);
+  }
+  void* memory = CHUNK_DATA(arena->chunks) + arena->used;
+  arena->used += size;
+  return memory;
+}
+
+void arena_release(arena_t* arena)
+{
+  thread_atomic_int_sub(&g_total_reserved, (int)arena->reserved);
+  arena_chunk_t* chunk = arena->chunks;
+  while (chunk != NULL) {
+    arena_chunk_t* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->used = arena->reserved = 0;
+}
+
+size_t arena_get_total_reserved()
+{
+  return (size_t)thread_atomic_int_load(&g_total_reserved);
+}
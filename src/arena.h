@@ -0,0 +1,22 @@
+#ifndef WNPCLI_ARENA_H
+#define WNPCLI_ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+// A bump allocator for memory that lives as long as a connection. Nothing
+// is freed on its own, arena_release hands all of it back at once.
+typedef struct {
+  arena_chunk_t* chunks;
+  size_t used;
+  size_t reserved;
+} arena_t;
+
+// Returns zeroed memory, or exits if there is none left
+extern void* arena_alloc(arena_t* arena, size_t size);
+extern void arena_release(arena_t* arena);
+// Bytes reserved by all arenas together
+extern size_t arena_get_total_reserved();
+
+#endif /* WNPCLI_ARENA_H */
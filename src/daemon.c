@@ -1,602 +1,3037 @@
+#include "arena.h"
+#include "fields.h"
 #include "wnpcli.h"
 
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
+
+// A compiled -p predicate like "state=playing,name~spotify". Matches are kept
+// per player id and only re-evaluated for players whose updated_at moved.
+#define MAX_PREDICATE_TERMS 8
+typedef struct {
+  int field;
+  char op;
+  char value[64];
+} predicate_term_t;
+
+typedef struct {
+  int term_count;
+  predicate_term_t terms[MAX_PREDICATE_TERMS];
+  bool matches[WNP_MAX_PLAYERS];
+  long long seen_updated_at[WNP_MAX_PLAYERS];
+} player_predicate_t;
+
+// A format string split into literal text, metadata keys with their
+// filters and {{?key}} sections. The source is owned by the client's arguments.
+#define MAX_FORMAT_SEGMENTS 32
+#define MAX_FORMAT_FILTERS 16
+#define MAX_FORMAT_SECTIONS 8
+
+enum FORMAT_SEGMENT {
+  SEGMENT_TEXT,
+  SEGMENT_FIELD,
+  SEGMENT_SECTION,
+  SEGMENT_SECTION_END,
+  SEGMENT_COMPUTED,
+};
+
+// Placeholders the daemon computes from several fields. Those depending on
+// the position use the position extrapolated from the last update.
+enum COMPUTED_FIELD {
+  COMPUTED_PROGRESS,
+  COMPUTED_PERCENT,
+  COMPUTED_REMAINING,
+  COMPUTED_VOLUME_BAR,
+};
+
+#define DEFAULT_BAR_WIDTH 10
+#define MAX_BAR_WIDTH 100
+
+enum FORMAT_FILTER {
+  FILTER_TRUNC,
+  FILTER_PAD,
+  FILTER_LPAD,
+  FILTER_UPPER,
+  FILTER_LOWER,
+  FILTER_ESCAPE_PANGO,
+  FILTER_ESCAPE_JSON,
+};
+
+typedef struct {
+  unsigned char type;
+  short arg;
+} format_filter_t;
+
+// Text segments are a range of the source. Sections store the index of
+// their SEGMENT_SECTION_END in start, to skip to it when the key is empty.
+// Computed segments store a COMPUTED_* in field and the bar width in len.
+typedef struct {
+  unsigned char type;
+  signed char field;
+  unsigned char first_filter;
+  unsigned char filter_count;
+  unsigned short start;
+  unsigned short len;
+} format_segment_t;
+
 typedef struct {
+  const char* source;
+  int default_start;
+  int default_len;
+  int segment_count;
+  format_segment_t segments[MAX_FORMAT_SEGMENTS];
+  // Whether the output changes while playing, without any update from the player
+  bool extrapolates;
+  int filter_count;
+  format_filter_t filters[MAX_FORMAT_FILTERS];
+} compiled_format_t;
+
+// A growable string, reused across renders so appending doesn't allocate
+// once it reached its working size. Buffers of a connection grow in its
+// arena and are released with it, others are heap allocated.
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  arena_t* arena;
+} strbuf_t;
+
+// What a -p all follower last reported for every player, so that only
+// additions, changes and removals have to be sent.
+typedef struct {
+  bool known[WNP_MAX_PLAYERS];
+  long long seen_updated_at[WNP_MAX_PLAYERS];
+  uint32_t render_hash[WNP_MAX_PLAYERS];
+  // Formatted ids can be as long as a name, removals are reported with these
+  char ids[WNP_MAX_PLAYERS][WNP_STR_LEN];
+  bool listed;
+} player_table_t;
+
+// An immutable copy of every player, captured once per libwnp update
+// and shared by all renders in that batch. Slots are indexed by player id.
+typedef struct {
+  long long version;
+  thread_atomic_int_t refcount;
+  int active_id;
+  int count;
+  int slot_of[WNP_MAX_PLAYERS];
+  wnp_player_t players[WNP_MAX_PLAYERS];
+} player_snapshot_t;
+
+// A named request from views.conf, with its formats compiled once. Every
+// connection using it holds a reference, so a reload only affects new ones.
+// Followers of a view share the last render of it, keyed by what it was
+// rendered from.
+#define MAX_VIEWS 32
+typedef struct {
+  char name[VIEW_NAME_LEN];
   arguments_t arguments;
-  char response[MAX_RESPONSE_LEN];
+  compiled_format_t formats[1 + MAX_NAMED_FORMATS];
+  bool extrapolates;
+  thread_atomic_int_t refcount;
+  thread_mutex_t render_lock;
+  long long render_version;
+  int render_player_id;
+  int render_position;
+  strbuf_t render_response;
+  strbuf_t render_encoded;
+} view_t;
+
+typedef struct {
+  arguments_t arguments;
+  // Text output, and the one before it to compare against when following
+  strbuf_t response;
+  strbuf_t response_previous;
   bool should_close;
   int client_fd;
+  int bound_id;
+  char bound_name[WNP_STR_LEN];
+  // Everything below that is only needed by some requests is allocated in
+  // the connection's arena on first use, and NULL until then.
+  arena_t* arena;
+  player_predicate_t* predicate;
+  player_table_t* table;
+  view_t* view;
+  strbuf_t stream_output;
+  strbuf_t encoded_output;
+  strbuf_t encoded_previous;
+  int player_last_id;
   long long player_last_updated_at;
+  player_snapshot_t* seen_snapshot;
+  uint32_t render_fields;
+  // The -f format at 0, followed by the -N named formats. Views point these at their own.
+  compiled_format_t* formats[1 + MAX_NAMED_FORMATS];
+  strbuf_t format_output;
+  strbuf_t filter_scratch[2];
+  // Wall clock time at which extrapolated placeholders change next, or 0
+  long long tick_at;
+  // --scroll keeps the whole output with the gap, and scrolls through it
+  // while the player is playing. scroll_length is 0 when everything fits.
+  strbuf_t scroll_text;
+  size_t scroll_length;
+  size_t scroll_offset;
+  uint32_t scroll_track;
+  long long scroll_next_at;
+  bool send_pending;
+  long long last_sent_at;
+  double tokens;
+  long long tokens_updated_at;
+  // Framed messages the follower's non-blocking socket didn't take yet.
+  // Only the shard thread touches these once the follower was added.
+  strbuf_t outbox;
+  bool dropped;
 } client_state_t;
 
+// Every follow connection gets a token bucket of bytes on top of its own
+// --max-rate, so a single client can't keep a shard busy with a flood of updates.
+#define FOLLOW_BURST_BYTES (256 * 1024)
+#define FOLLOW_BYTES_PER_SEC (64 * 1024)
+
+// Followers with more than this waiting, in their outbox or piled up while the
+// bucket held them back, can't keep up and get disconnected.
+// Outboxes that didn't drain are retried after FOLLOW_RETRY_MS.
+#define FOLLOW_MAX_QUEUED (1024 * 1024)
+#define FOLLOW_RETRY_MS 50
+
+// Followers are spread over one shard per core. Each shard has its own
+// thread that renders and sends updates for the followers it owns. Sockets
+// are written to under flush_lock only, so broadcasts never wait for a client.
 #define MAX_STATES 64
-client_state_t* g_states[MAX_STATES] = {0};
+#define MAX_SHARDS 16
+typedef struct {
+  thread_ptr_t thread;
+  thread_signal_t wake;
+  thread_mutex_t lock;
+  thread_mutex_t flush_lock;
+  client_state_t* states[MAX_STATES];
+  int state_count;
+  int event_state_count;
+  player_snapshot_t* pending;
+  bool pending_selected_only;
+  // Version of the newest snapshot handed to the shard, pending or rendered
+  long long version;
+  strbuf_t pending_events[ENCODING_COUNT];
+} follower_shard_t;
+
+follower_shard_t g_shards[MAX_SHARDS];
+int g_shard_count = 0;
+thread_atomic_int_t g_event_followers;
+thread_atomic_int_t g_connection_count;
 int g_selected_player_id = PLAYER_ID_ACTIVE;
 
+thread_mutex_t g_snapshot_lock;
+player_snapshot_t* g_snapshot = NULL;
+long long g_snapshot_version = 0;
+
+// Released snapshots are kept for the next update, so publishing one
+// doesn't allocate every time. g_snapshot_count counts pooled ones too.
+#define SNAPSHOT_POOL_SIZE 4
+thread_mutex_t g_snapshot_pool_lock;
+player_snapshot_t* g_snapshot_pool[SNAPSHOT_POOL_SIZE];
+int g_snapshot_pool_count = 0;
+thread_atomic_int_t g_snapshot_count;
+
+// Events are encoded once into these and copied to every shard.
+thread_mutex_t g_event_lock;
+strbuf_t g_event_encoded[ENCODING_COUNT];
+
+// views.conf is reloaded when a view is requested after it changed.
+thread_mutex_t g_view_lock;
+view_t* g_views[MAX_VIEWS];
+int g_view_count = 0;
+time_t g_views_mtime = 0;
+long long g_views_size = -1;
+
+#define INDEX_BUCKETS 128
+
+// Live player ids, linked in id order and in order of most recent activity,
+// so selection can step to a neighbour without probing every possible id.
+typedef struct {
+  bool live[WNP_MAX_PLAYERS];
+  int next[WNP_MAX_PLAYERS];
+  int prev[WNP_MAX_PLAYERS];
+  int recent_next[WNP_MAX_PLAYERS];
+  int recent_prev[WNP_MAX_PLAYERS];
+  long active_at[WNP_MAX_PLAYERS];
+  int first;
+  int most_recent;
+  // Hash chains from formatted id ("spotify3") and lowercase name ("spotify") to player ids.
+  uint32_t id_hash[WNP_MAX_PLAYERS];
+  uint32_t name_hash[WNP_MAX_PLAYERS];
+  int id_chain[WNP_MAX_PLAYERS];
+  int name_chain[WNP_MAX_PLAYERS];
+  int id_buckets[INDEX_BUCKETS];
+  int name_buckets[INDEX_BUCKETS];
+} player_index_t;
+
+thread_mutex_t g_index_lock;
+player_index_t g_index = {.first = -1, .most_recent = -1};
+
+// With --active-debounce, a newly reported active player is only committed
+// once libwnp kept reporting it for that many milliseconds.
+int g_active_debounce_ms = 0;
+thread_mutex_t g_active_lock;
+thread_signal_t g_active_wake;
+int g_active_player_id = -1;
+int g_active_candidate_id = -1;
+long long g_active_candidate_since = 0;
+
+static long long get_wall_time_ms()
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long get_time_ms()
+{
+#ifdef _WIN32
+  return (long long)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void strbuf_reserve(strbuf_t* buf, size_t len)
+{
+  if (buf->len + len + 1 <= buf->cap) return;
+  size_t cap = buf->cap == 0 ? 256 : buf->cap;
+  while (cap < buf->len + len + 1) {
+    cap *= 2;
+  }
+  char* data;
+  if (buf->arena != NULL) {
+    // The old space stays in the arena, doubling keeps that under the size of the buffer
+    data = arena_alloc(buf->arena, cap);
+    if (buf->data != NULL) memcpy(data, buf->data, buf->len + 1);
+  } else {
+    data = realloc(buf->data, cap);
+  }
+  if (data == NULL) {
+    perror("Failed to grow buffer");
+    exit(EXIT_FAILURE);
+  }
+  buf->data = data;
+  buf->cap = cap;
+}
+
+static void strbuf_append_len(strbuf_t* buf, const char* str, size_t len)
+{
+  strbuf_reserve(buf, len);
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+static void strbuf_append(strbuf_t* buf, const char* str)
+{
+  strbuf_append_len(buf, str, strlen(str));
+}
+
+// Appends printf style, formatting straight into the spare capacity when it fits.
+static void strbuf_printf(strbuf_t* buf, const char* format, ...)
+{
+  va_list args;
+  strbuf_reserve(buf, 64);
+  va_start(args, format);
+  int len = vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+  va_end(args);
+  if (len < 0) {
+    buf->data[buf->len] = '\0';
+    return;
+  }
+
+  if ((size_t)len >= buf->cap - buf->len) {
+    strbuf_reserve(buf, len);
+    va_start(args, format);
+    vsnprintf(buf->data + buf->len, len + 1, format, args);
+    va_end(args);
+  }
+  buf->len += len;
+}
+
+// Never NULL, unlike data of a buffer that wasn't written to yet.
+static const char* strbuf_str(const strbuf_t* buf)
+{
+  return buf->data != NULL ? buf->data : "";
+}
+
+static void strbuf_clear(strbuf_t* buf)
+{
+  buf->len = 0;
+  if (buf->data != NULL) buf->data[0] = '\0';
+}
+
+static void strbuf_free(strbuf_t* buf)
+{
+  if (buf->arena == NULL) free(buf->data);
+  buf->data = NULL;
+  buf->len = buf->cap = 0;
+}
+
+// A minimal streaming JSON writer. Values are escaped straight into the
+// buffer, so nothing is allocated once the buffer reached its working size.
+typedef struct {
+  strbuf_t* out;
+  bool first;
+} json_writer_t;
+
+static void json_begin(json_writer_t* writer, strbuf_t* out, const char* open)
+{
+  writer->out = out;
+  writer->first = true;
+  strbuf_append(out, open);
+}
+
+static void json_end(json_writer_t* writer, const char* close)
+{
+  strbuf_append(writer->out, close);
+}
+
+static void json_append_string(strbuf_t* out, const char* str)
+{
+  strbuf_append_len(out, "\"", 1);
+  const char* run = str;
+  for (const char* p = str; *p != '\0'; p++) {
+    unsigned char c = *p;
+    if (c != '"' && c != '\\' && c >= 0x20) continue;
+
+    strbuf_append_len(out, run, p - run);
+    run = p + 1;
+    char escaped[8];
+    switch (c) {
+      case '"':
+        strbuf_append_len(out, "\\\"", 2);
+        break;
+      case '\\':
+        strbuf_append_len(out, "\\\\", 2);
+        break;
+      case '\n':
+        strbuf_append_len(out, "\\n", 2);
+        break;
+      case '\r':
+        strbuf_append_len(out, "\\r", 2);
+        break;
+      case '\t':
+        strbuf_append_len(out, "\\t", 2);
+        break;
+      default:
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        strbuf_append_len(out, escaped, 6);
+        break;
+    }
+  }
+  strbuf_append(out, run);
+  strbuf_append_len(out, "\"", 1);
+}
+
+// Starts the next member. Array elements pass a NULL key.
+static void json_key(json_writer_t* writer, const char* key)
+{
+  if (!writer->first) strbuf_append_len(writer->out, ",", 1);
+  writer->first = false;
+  if (key != NULL) {
+    json_append_string(writer->out, key);
+    strbuf_append_len(writer->out, ":", 1);
+  }
+}
+
+static void json_add_string(json_writer_t* writer, const char* key, const char* value)
+{
+  json_key(writer, key);
+  json_append_string(writer->out, value);
+}
+
+static void json_add_int(json_writer_t* writer, const char* key, long long value)
+{
+  char number[32];
+  json_key(writer, key);
+  strbuf_append_len(writer->out, number, snprintf(number, sizeof(number), "%lld", value));
+}
+
+static void json_add_bool(json_writer_t* writer, const char* key, bool value)
+{
+  json_key(writer, key);
+  strbuf_append(writer->out, value ? "true" : "false");
+}
+
+static void json_add_raw(json_writer_t* writer, const char* key, const char* raw)
+{
+  json_key(writer, key);
+  strbuf_append(writer->out, raw);
+}
+
+static void send_message_len(int client_fd, const char* message, size_t message_len)
+{
+  if (message != NULL && send_all(client_fd, &message_len, sizeof(message_len))) {
+    send_all(client_fd, message, message_len);
+  }
+}
+
 static void send_message(int client_fd, const char* message)
 {
   if (message != NULL) {
-    size_t message_len = strlen(message);
-    send(client_fd, &message_len, sizeof(message_len), 0);
-    send(client_fd, message, message_len, 0);
+    send_message_len(client_fd, message, strlen(message));
   }
 }
 
-static bool get_player_from_state(client_state_t* state, wnp_player_t* player_out)
+// Followers' sockets are non-blocking, so that a client that stops reading
+// can't hold up the shard that sends to it.
+static void set_nonblocking(int fd, bool nonblocking)
 {
-  switch (state->arguments.player_id) {
-    case PLAYER_ID_ACTIVE:
-      return wnp_get_active_player(player_out);
-    case PLAYER_ID_SELECTED:
-      if (g_selected_player_id == PLAYER_ID_ACTIVE) {
-        return wnp_get_active_player(player_out);
-      } else {
-        if (wnp_get_player(g_selected_player_id, player_out)) {
-          return true;
-        } else {
-          g_selected_player_id = PLAYER_ID_ACTIVE;
-          return wnp_get_active_player(player_out);
-        }
+#ifdef _WIN32
+  u_long mode = nonblocking;
+  ioctlsocket(fd, FIONBIO, &mode);
+#else
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
+// Sends as much as the non-blocking socket takes right now. Returns false if
+// the client is gone.
+static bool send_available(int fd, const char* data, size_t len, size_t* sent_out)
+{
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  size_t sent = 0;
+  while (sent < len) {
+    int result = send(fd, data + sent, (int)(len - sent), flags);
+    if (result > 0) {
+      sent += result;
+      continue;
+    }
+#ifdef _WIN32
+    if (result < 0 && WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+#endif
+    return false;
+  }
+  *sent_out = sent;
+  return true;
+}
+
+// Waits until the client hung up, or its shard disconnected it.
+static void wait_for_disconnect(int fd)
+{
+#ifdef _WIN32
+  WSAPOLLFD poll_fd = {.fd = (SOCKET)fd, .events = POLLRDNORM};
+  WSAPoll(&poll_fd, 1, -1);
+#else
+  struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+  while (poll(&poll_fd, 1, -1) < 0 && errno == EINTR) {
+  }
+#endif
+}
+
+static const wnp_player_t g_default_player = WNP_DEFAULT_PLAYER;
+static void assign_str(char dest[WNP_STR_LEN], const char* str)
+{
+  if (str == NULL) return;
+  size_t len = strlen(str);
+  strncpy(dest, str, WNP_STR_LEN - 1);
+  dest[len < WNP_STR_LEN ? len : WNP_STR_LEN - 1] = '\0';
+}
+
+static const wnp_player_t* snapshot_get_player(player_snapshot_t* snapshot, int id)
+{
+  if (snapshot == NULL || id < 0 || id >= WNP_MAX_PLAYERS || snapshot->slot_of[id] == -1) {
+    return NULL;
+  }
+  return &snapshot->players[snapshot->slot_of[id]];
+}
+
+static void recent_unlink(int id)
+{
+  if (g_index.recent_next[id] == id) {
+    g_index.most_recent = -1;
+    return;
+  }
+  g_index.recent_next[g_index.recent_prev[id]] = g_index.recent_next[id];
+  g_index.recent_prev[g_index.recent_next[id]] = g_index.recent_prev[id];
+  if (g_index.most_recent == id) {
+    g_index.most_recent = g_index.recent_next[id];
+  }
+}
+
+static void recent_push_front(int id)
+{
+  if (g_index.most_recent == -1) {
+    g_index.recent_next[id] = g_index.recent_prev[id] = id;
+  } else {
+    int head = g_index.most_recent;
+    int tail = g_index.recent_prev[head];
+    g_index.recent_next[id] = head;
+    g_index.recent_prev[id] = tail;
+    g_index.recent_next[tail] = id;
+    g_index.recent_prev[head] = id;
+  }
+  g_index.most_recent = id;
+}
+
+// FNV-1a over the lowercased string, continuing from hash.
+static uint32_t hash_lowercase(uint32_t hash, const char* str)
+{
+  for (const char* p = str; *p; p++) {
+    hash ^= (unsigned char)tolower(*p);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t hash_player_name(const char* name)
+{
+  return hash_lowercase(2166136261u, name);
+}
+
+static uint32_t hash_formatted_id(const char* name, int id)
+{
+  char id_str[16];
+  snprintf(id_str, sizeof(id_str), "%d", id);
+  return hash_lowercase(hash_player_name(name), id_str);
+}
+
+static void chain_insert(int* buckets, int* chain, uint32_t hash, int id)
+{
+  int bucket = hash % INDEX_BUCKETS;
+  chain[id] = buckets[bucket];
+  buckets[bucket] = id;
+}
+
+static void chain_remove(int* buckets, int* chain, uint32_t hash, int id)
+{
+  int* link = &buckets[hash % INDEX_BUCKETS];
+  while (*link != -1) {
+    if (*link == id) {
+      *link = chain[id];
+      return;
+    }
+    link = &chain[*link];
+  }
+}
+
+static void hash_insert(const wnp_player_t* player)
+{
+  g_index.id_hash[player->id] = hash_formatted_id(player->name, player->id);
+  g_index.name_hash[player->id] = hash_player_name(player->name);
+  chain_insert(g_index.id_buckets, g_index.id_chain, g_index.id_hash[player->id], player->id);
+  chain_insert(g_index.name_buckets, g_index.name_chain, g_index.name_hash[player->id], player->id);
+}
+
+static void hash_remove(int id)
+{
+  chain_remove(g_index.id_buckets, g_index.id_chain, g_index.id_hash[id], id);
+  chain_remove(g_index.name_buckets, g_index.name_chain, g_index.name_hash[id], id);
+}
+
+static void player_index_init()
+{
+  thread_mutex_init(&g_index_lock);
+  for (int i = 0; i < INDEX_BUCKETS; i++) {
+    g_index.id_buckets[i] = -1;
+    g_index.name_buckets[i] = -1;
+  }
+}
+
+static void player_index_add(const wnp_player_t* player)
+{
+  int id = player->id;
+  if (id < 0 || id >= WNP_MAX_PLAYERS) return;
+
+  thread_mutex_lock(&g_index_lock);
+  if (!g_index.live[id]) {
+    g_index.live[id] = true;
+    g_index.active_at[id] = player->active_at;
+
+    // Adding is rare, so finding the id-order neighbour may walk.
+    int after = -1;
+    for (int i = id + 1; i < id + WNP_MAX_PLAYERS && after == -1; i++) {
+      if (g_index.live[i % WNP_MAX_PLAYERS] && i % WNP_MAX_PLAYERS != id) after = i % WNP_MAX_PLAYERS;
+    }
+    if (after == -1) {
+      g_index.next[id] = g_index.prev[id] = id;
+    } else {
+      int before = g_index.prev[after];
+      g_index.next[id] = after;
+      g_index.prev[id] = before;
+      g_index.next[before] = id;
+      g_index.prev[after] = id;
+    }
+    if (g_index.first == -1 || id < g_index.first) {
+      g_index.first = id;
+    }
+
+    recent_push_front(id);
+    hash_insert(player);
+  }
+  thread_mutex_unlock(&g_index_lock);
+}
+
+static void player_index_remove(const wnp_player_t* player)
+{
+  int id = player->id;
+  if (id < 0 || id >= WNP_MAX_PLAYERS) return;
+
+  thread_mutex_lock(&g_index_lock);
+  if (g_index.live[id]) {
+    g_index.live[id] = false;
+    if (g_index.next[id] == id) {
+      g_index.first = -1;
+    } else {
+      g_index.next[g_index.prev[id]] = g_index.next[id];
+      g_index.prev[g_index.next[id]] = g_index.prev[id];
+      if (g_index.first == id) {
+        g_index.first = g_index.next[id];
       }
-      break;
-    default:
-      if (state->arguments.player_id >= WNP_MAX_PLAYERS) {
-        return wnp_get_player(0, player_out);
-      } else {
-        return wnp_get_player(state->arguments.player_id, player_out);
+    }
+    recent_unlink(id);
+    hash_remove(id);
+  }
+  thread_mutex_unlock(&g_index_lock);
+}
+
+static void player_index_update(const wnp_player_t* player)
+{
+  int id = player->id;
+  if (id < 0 || id >= WNP_MAX_PLAYERS) return;
+
+  thread_mutex_lock(&g_index_lock);
+  if (g_index.live[id] && g_index.name_hash[id] != hash_player_name(player->name)) {
+    hash_remove(id);
+    hash_insert(player);
+  }
+  if (g_index.live[id] && player->active_at > g_index.active_at[id]) {
+    g_index.active_at[id] = player->active_at;
+    if (g_index.most_recent != id) {
+      recent_unlink(id);
+      recent_push_front(id);
+    }
+  }
+  thread_mutex_unlock(&g_index_lock);
+}
+
+// Steps from id to the neighbouring live player, either in id order or from
+// more to less recently active. Unknown ids start at the first player.
+static int player_index_step(int id, bool recent, bool forward)
+{
+  thread_mutex_lock(&g_index_lock);
+  int found = recent ? g_index.most_recent : g_index.first;
+  if (id >= 0 && id < WNP_MAX_PLAYERS && g_index.live[id]) {
+    if (recent) {
+      found = forward ? g_index.recent_next[id] : g_index.recent_prev[id];
+    } else {
+      found = forward ? g_index.next[id] : g_index.prev[id];
+    }
+  }
+  thread_mutex_unlock(&g_index_lock);
+
+  return found;
+}
+
+static bool name_equals(const char* name, const char* lowercase)
+{
+  for (; *name && *lowercase; name++, lowercase++) {
+    if (tolower((unsigned char)*name) != *lowercase) return false;
+  }
+  return *name == *lowercase;
+}
+
+static bool formatted_id_equals(const wnp_player_t* player, const char* lowercase)
+{
+  size_t name_len = strlen(player->name);
+  if (strlen(lowercase) <= name_len) return false;
+  for (size_t i = 0; i < name_len; i++) {
+    if (tolower((unsigned char)player->name[i]) != lowercase[i]) return false;
+  }
+  char id_str[16];
+  snprintf(id_str, sizeof(id_str), "%d", player->id);
+  return strcmp(lowercase + name_len, id_str) == 0;
+}
+
+// Looks up a lowercase formatted id, or failing that a lowercase player name.
+// Names can be shared, in which case the most recently active player wins.
+// Hash hits are confirmed against the snapshot, so this only returns players in it.
+static int player_index_find(player_snapshot_t* snapshot, const char* lowercase)
+{
+  int found = -1;
+  thread_mutex_lock(&g_index_lock);
+  uint32_t id_hash = hash_lowercase(2166136261u, lowercase);
+  for (int id = g_index.id_buckets[id_hash % INDEX_BUCKETS]; id >= 0 && id < WNP_MAX_PLAYERS && found == -1; id = g_index.id_chain[id]) {
+    const wnp_player_t* player = snapshot_get_player(snapshot, id);
+    if (g_index.id_hash[id] == id_hash && player != NULL && formatted_id_equals(player, lowercase)) {
+      found = id;
+    }
+  }
+
+  for (int id = g_index.name_buckets[id_hash % INDEX_BUCKETS]; id >= 0 && id < WNP_MAX_PLAYERS && found == -1; id = g_index.name_chain[id]) {
+    const wnp_player_t* player = snapshot_get_player(snapshot, id);
+    if (g_index.name_hash[id] == id_hash && player != NULL && name_equals(player->name, lowercase)) {
+      for (int other = id; other >= 0 && other < WNP_MAX_PLAYERS; other = g_index.name_chain[other]) {
+        const wnp_player_t* other_player = snapshot_get_player(snapshot, other);
+        if (g_index.name_hash[other] == id_hash && other_player != NULL && name_equals(other_player->name, lowercase) &&
+            other_player->active_at > player->active_at) {
+          player = other_player;
+        }
       }
+      found = player->id;
+    }
+  }
+  thread_mutex_unlock(&g_index_lock);
+
+  return found;
+}
+
+static int player_index_next(int id, bool recent)
+{
+  return player_index_step(id, recent, true);
+}
+
+static int player_index_previous(int id, bool recent)
+{
+  return player_index_step(id, recent, false);
+}
+
+static void note_active_candidate(int reported_id)
+{
+  if (reported_id == g_active_player_id) {
+    g_active_candidate_id = reported_id;
+  } else if (reported_id != g_active_candidate_id) {
+    g_active_candidate_id = reported_id;
+    g_active_candidate_since = get_time_ms();
+    thread_signal_raise(&g_active_wake);
+  }
+}
+
+static int resolve_active_id(player_snapshot_t* snapshot, int reported_id)
+{
+  if (g_active_debounce_ms <= 0) {
+    return reported_id;
+  }
+
+  thread_mutex_lock(&g_active_lock);
+  int committed_slot = g_active_player_id >= 0 ? snapshot->slot_of[g_active_player_id] : -1;
+  if (committed_slot == -1) {
+    // Nothing to hold on to, so there's no flapping to suppress either.
+    g_active_player_id = reported_id;
+    g_active_candidate_id = reported_id;
+  } else {
+    note_active_candidate(reported_id);
+    if (g_active_candidate_id != g_active_player_id && get_time_ms() - g_active_candidate_since >= g_active_debounce_ms) {
+      g_active_player_id = g_active_candidate_id;
+    }
+  }
+  int active_id = g_active_player_id;
+  thread_mutex_unlock(&g_active_lock);
+
+  return active_id;
+}
+
+static player_snapshot_t* capture_snapshot()
+{
+  // Every field is overwritten below, players only up to count, so pooled snapshots aren't cleared.
+  player_snapshot_t* snapshot = NULL;
+  thread_mutex_lock(&g_snapshot_pool_lock);
+  if (g_snapshot_pool_count > 0) {
+    snapshot = g_snapshot_pool[--g_snapshot_pool_count];
+  }
+  thread_mutex_unlock(&g_snapshot_pool_lock);
+  if (snapshot == NULL) {
+    snapshot = malloc(sizeof(player_snapshot_t));
+    if (snapshot == NULL) {
+      return NULL;
+    }
+    thread_atomic_int_inc(&g_snapshot_count);
+  }
+
+  thread_atomic_int_store(&snapshot->refcount, 1);
+  snapshot->count = wnp_get_all_players(snapshot->players);
+  for (int i = 0; i < WNP_MAX_PLAYERS; i++) {
+    snapshot->slot_of[i] = -1;
+  }
+  for (int i = 0; i < snapshot->count; i++) {
+    int id = snapshot->players[i].id;
+    if (id >= 0 && id < WNP_MAX_PLAYERS) {
+      snapshot->slot_of[id] = i;
+    }
+  }
+
+  wnp_player_t active = WNP_DEFAULT_PLAYER;
+  snapshot->active_id = resolve_active_id(snapshot, wnp_get_active_player(&active) ? active.id : -1);
+
+  return snapshot;
+}
+
+static void release_snapshot(player_snapshot_t* snapshot)
+{
+  if (snapshot == NULL || thread_atomic_int_dec(&snapshot->refcount) != 1) return;
+
+  thread_mutex_lock(&g_snapshot_pool_lock);
+  if (g_snapshot_pool_count < SNAPSHOT_POOL_SIZE) {
+    g_snapshot_pool[g_snapshot_pool_count++] = snapshot;
+    snapshot = NULL;
+  }
+  thread_mutex_unlock(&g_snapshot_pool_lock);
+  if (snapshot != NULL) {
+    free(snapshot);
+    thread_atomic_int_dec(&g_snapshot_count);
+  }
+}
+
+// Replaces the current snapshot with a freshly captured one and returns
+// a reference to it, which the caller has to release.
+// Several threads publish at once, so the version is taken before capturing.
+// A capture that started later saw every change an earlier one was made for,
+// which is why a snapshot is dropped in favour of one with a higher version.
+static player_snapshot_t* publish_snapshot()
+{
+  thread_mutex_lock(&g_snapshot_lock);
+  long long version = ++g_snapshot_version;
+  thread_mutex_unlock(&g_snapshot_lock);
+
+  player_snapshot_t* snapshot = capture_snapshot();
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  snapshot->version = version;
+
+  thread_mutex_lock(&g_snapshot_lock);
+  player_snapshot_t* previous = g_snapshot;
+  if (previous != NULL && previous->version > version) {
+    thread_atomic_int_inc(&previous->refcount);
+    thread_mutex_unlock(&g_snapshot_lock);
+    release_snapshot(snapshot);
+    return previous;
+  }
+  g_snapshot = snapshot;
+  thread_atomic_int_inc(&snapshot->refcount);
+  thread_mutex_unlock(&g_snapshot_lock);
+
+  release_snapshot(previous);
+  return snapshot;
+}
+
+static player_snapshot_t* acquire_snapshot()
+{
+  thread_mutex_lock(&g_snapshot_lock);
+  player_snapshot_t* snapshot = g_snapshot;
+  if (snapshot != NULL) {
+    thread_atomic_int_inc(&snapshot->refcount);
+  }
+  thread_mutex_unlock(&g_snapshot_lock);
+
+  return snapshot != NULL ? snapshot : publish_snapshot();
+}
+
+static bool parse_predicate(const char* query, player_predicate_t* predicate_out)
+{
+  memset(predicate_out, 0, sizeof(player_predicate_t));
+  for (int i = 0; i < WNP_MAX_PLAYERS; i++) {
+    predicate_out->seen_updated_at[i] = -1;
+  }
+
+  const char* term = query;
+  while (*term != '\0') {
+    if (predicate_out->term_count == MAX_PREDICATE_TERMS) return false;
+    predicate_term_t* out = &predicate_out->terms[predicate_out->term_count++];
+
+    const char* end = strchr(term, ',');
+    if (end == NULL) end = term + strlen(term);
+    const char* op = strpbrk(term, "=~!");
+    if (op == NULL || op >= end) return false;
+
+    const field_t* field = find_field(term, op - term);
+    if (field == NULL) return false;
+    out->field = field->id;
+
+    // "!=" is stored as '!', "=" and "~" as themselves
+    out->op = *op;
+    const char* value = op + 1;
+    if (*op == '!') {
+      if (*value != '=') return false;
+      value++;
+    }
+    size_t value_len = end - value;
+    if (value_len >= sizeof(out->value)) return false;
+    memcpy(out->value, value, value_len);
+    out->value[value_len] = '\0';
+
+    term = *end == ',' ? end + 1 : end;
+  }
+
+  return predicate_out->term_count > 0;
+}
+
+static bool contains_lowercase(const char* haystack, const char* needle)
+{
+  size_t needle_len = strlen(needle);
+  for (const char* h = haystack; *h; h++) {
+    size_t i = 0;
+    while (i < needle_len && h[i] && tolower((unsigned char)h[i]) == needle[i]) i++;
+    if (i == needle_len) return true;
+  }
+  return needle_len == 0;
+}
+
+static bool predicate_matches(const player_predicate_t* predicate, const wnp_player_t* player)
+{
+  for (int i = 0; i < predicate->term_count; i++) {
+    const predicate_term_t* term = &predicate->terms[i];
+    char text[FIELD_VALUE_LEN];
+    format_field(player, term->field, text);
+
+    bool matched = term->op == '~' ? contains_lowercase(text, term->value) : name_equals(text, term->value);
+    if (matched == (term->op == '!')) return false;
+  }
+
+  return true;
+}
+
+static const wnp_player_t* resolve_player_predicate(player_predicate_t* predicate, player_snapshot_t* snapshot)
+{
+  const wnp_player_t* best = NULL;
+  for (int i = 0; i < snapshot->count; i++) {
+    const wnp_player_t* player = &snapshot->players[i];
+    if (player->id < 0 || player->id >= WNP_MAX_PLAYERS) continue;
+
+    if (predicate->seen_updated_at[player->id] != player->updated_at) {
+      predicate->matches[player->id] = predicate_matches(predicate, player);
+      predicate->seen_updated_at[player->id] = player->updated_at;
+    }
+    if (predicate->matches[player->id] && (best == NULL || player->active_at > best->active_at)) {
+      best = player;
+    }
+  }
+
+  return best;
+}
+
+// Followers stay on the player they first resolved to while its id still
+// belongs to a player of that name, and rebind by name once it doesn't.
+static const wnp_player_t* resolve_player_query(client_state_t* state, player_snapshot_t* snapshot)
+{
+  if (state->predicate != NULL) {
+    return resolve_player_predicate(state->predicate, snapshot);
+  }
+
+  const wnp_player_t* bound = snapshot_get_player(snapshot, state->bound_id);
+  if (bound != NULL && name_equals(bound->name, state->bound_name)) {
+    return bound;
+  }
+
+  int id = player_index_find(snapshot, state->arguments.player_query);
+  if (id == -1 && state->bound_name[0] != '\0') {
+    id = player_index_find(snapshot, state->bound_name);
+  }
+
+  const wnp_player_t* player = snapshot_get_player(snapshot, id);
+  if (player != NULL) {
+    state->bound_id = player->id;
+    assign_str(state->bound_name, player->name);
+    for (char* p = state->bound_name; *p; ++p) {
+      *p = tolower(*p);
+    }
+  }
+
+  return player;
+}
+
+static const wnp_player_t* get_player_from_state(client_state_t* state, player_snapshot_t* snapshot)
+{
+  const wnp_player_t* player = NULL;
+  switch (state->arguments.player_id) {
+    case PLAYER_ID_ACTIVE:
+      player = snapshot_get_player(snapshot, snapshot->active_id);
+      break;
+    case PLAYER_ID_SELECTED:
+      if (g_selected_player_id != PLAYER_ID_ACTIVE) {
+        player = snapshot_get_player(snapshot, g_selected_player_id);
+        if (player == NULL) {
+          g_selected_player_id = PLAYER_ID_ACTIVE;
+        }
+      }
+      if (player == NULL) {
+        player = snapshot_get_player(snapshot, snapshot->active_id);
+      }
+      break;
+    case PLAYER_ID_QUERY:
+      player = resolve_player_query(state, snapshot);
+      break;
+    default:
+      if (state->arguments.player_id >= WNP_MAX_PLAYERS) {
+        player = snapshot_get_player(snapshot, 0);
+      } else {
+        player = snapshot_get_player(snapshot, state->arguments.player_id);
+      }
+  }
+
+  return player != NULL ? player : &g_default_player;
+}
+
+/**
+ * On windows, taskkill and taskmgr don't fire
+ * SIGTERM, so uh, cope? If you taskkill it then
+ * you better know what you're doing anyway.
+ *
+ * It sends WM_CLOSE but we have no window so meh.
+ **/
+void signal_handler(int signum)
+{
+  wnp_uninit();
+  exit(0);
+}
+
+static void append_response(client_state_t* state, const char* key, const char* value)
+{
+  strbuf_printf(&state->response, "%-30s %s\n", key, value);
+}
+
+static void json_add_field(json_writer_t* writer, const wnp_player_t* player, int field)
+{
+  char scratch[WNP_STR_LEN] = {0};
+  field_value_t value = g_fields[field].get(player, scratch);
+  switch (value.type) {
+    case FIELD_STRING:
+    case FIELD_ENUM:
+      json_add_string(writer, g_fields[field].name, value.string);
+      break;
+    case FIELD_INT:
+    case FIELD_TIME:
+      json_add_int(writer, g_fields[field].name, value.number);
+      break;
+    case FIELD_BOOL:
+      json_add_bool(writer, g_fields[field].name, value.number != 0);
+      break;
+  }
+}
+
+// Writes the player as one JSON object with native types. The -sec keys
+// are left out of the full object since position and duration already are
+// plain seconds there. Only fields in the mask are written for METADATA_ALL.
+static void write_player_json(strbuf_t* out, const wnp_player_t* player, int field, uint32_t fields)
+{
+  json_writer_t writer;
+  json_begin(&writer, out, "{");
+  if (player->id == -1) {
+    // No player, an empty object
+  } else if (field == METADATA_ALL) {
+    for (int i = 0; i < METADATA_COUNT; i++) {
+      if (i == METADATA_POSITION_SEC || i == METADATA_DURATION_SEC || !(fields & g_fields[i].dirty_bit)) continue;
+      json_add_field(&writer, player, i);
+    }
+  } else {
+    json_add_field(&writer, player, field);
+  }
+  json_end(&writer, "}");
+}
+
+// The binary encoding is a stream of records, each starting with its type:
+//   BINARY_PLAYER:  id, field count, then (field id, value) pairs
+//   BINARY_REMOVED: id
+//   BINARY_EVENT:   timestamp, event type, id, mask of changed field ids
+// Field ids are METADATA_*. Strings are a varint length followed by UTF-8,
+// ints are zigzag varints, bools and enums plain varints.
+enum BINARY_RECORD {
+  BINARY_PLAYER = 1,
+  BINARY_REMOVED = 2,
+  BINARY_EVENT = 3,
+};
+
+static void binary_append_varint(strbuf_t* out, unsigned long long value)
+{
+  char bytes[10];
+  size_t len = 0;
+  do {
+    bytes[len] = value & 0x7f;
+    value >>= 7;
+    if (value != 0) bytes[len] |= 0x80;
+    len++;
+  } while (value != 0);
+  strbuf_append_len(out, bytes, len);
+}
+
+static void binary_append_string(strbuf_t* out, const char* str)
+{
+  size_t len = strlen(str);
+  binary_append_varint(out, len);
+  strbuf_append_len(out, str, len);
+}
+
+static void write_player_binary(strbuf_t* out, const wnp_player_t* player, int field, uint32_t fields)
+{
+  if (field != METADATA_ALL) fields = g_fields[field].dirty_bit;
+  if (player->id == -1) fields = 0;
+
+  char formatted_id[WNP_STR_LEN] = {0};
+  int count = 0;
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    if (fields & g_fields[i].dirty_bit) count++;
+  }
+
+  binary_append_varint(out, BINARY_PLAYER);
+  if (player->id != -1) get_formatted_id(player, formatted_id);
+  binary_append_string(out, formatted_id);
+  binary_append_varint(out, count);
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    if (!(fields & g_fields[i].dirty_bit)) continue;
+    field_value_t value = g_fields[i].get(player, formatted_id);
+    binary_append_varint(out, i);
+    if (value.type == FIELD_STRING) {
+      binary_append_string(out, value.string);
+    } else if (value.type == FIELD_INT || value.type == FIELD_TIME) {
+      binary_append_varint(out, ((unsigned long long)value.number << 1) ^ (unsigned long long)(value.number >> 63));
+    } else {
+      binary_append_varint(out, value.number);
+    }
+  }
+}
+
+static bool parse_format_filter(const char* filter, size_t len, format_filter_t* out)
+{
+  const char* colon = memchr(filter, ':', len);
+  size_t name_len = colon == NULL ? len : (size_t)(colon - filter);
+  const char* arg = colon == NULL ? "" : colon + 1;
+  size_t arg_len = colon == NULL ? 0 : len - name_len - 1;
+
+  const char* names[] = {"trunc", "pad", "lpad", "upper", "lower", "escape"};
+  int type = -1;
+  for (int i = 0; i < 6; i++) {
+    if (strlen(names[i]) == name_len && strncmp(filter, names[i], name_len) == 0) type = i;
+  }
+
+  out->arg = 0;
+  if (type == FILTER_TRUNC || type == FILTER_PAD || type == FILTER_LPAD) {
+    if (arg_len == 0 || arg_len > 4) return false;
+    for (size_t i = 0; i < arg_len; i++) {
+      if (!isdigit((unsigned char)arg[i])) return false;
+      out->arg = out->arg * 10 + (arg[i] - '0');
+    }
+  } else if (type == FILTER_UPPER || type == FILTER_LOWER) {
+    if (colon != NULL) return false;
+  } else if (type == FILTER_ESCAPE_PANGO && arg_len == 5 && strncmp(arg, "pango", 5) == 0) {
+    type = FILTER_ESCAPE_PANGO;
+  } else if (type == FILTER_ESCAPE_PANGO && arg_len == 4 && strncmp(arg, "json", 4) == 0) {
+    type = FILTER_ESCAPE_JSON;
+  } else {
+    return false;
+  }
+
+  out->type = type;
+  return true;
+}
+
+static bool parse_computed_field(const char* name, size_t len, format_segment_t* segment)
+{
+  const char* names[] = {"progress", "percent", "remaining", "volume-bar"};
+  const char* colon = memchr(name, ':', len);
+  size_t name_len = colon == NULL ? len : (size_t)(colon - name);
+
+  for (int i = 0; i < 4; i++) {
+    if (strlen(names[i]) != name_len || strncmp(name, names[i], name_len) != 0) continue;
+    bool is_bar = i == COMPUTED_PROGRESS || i == COMPUTED_VOLUME_BAR;
+    segment->type = SEGMENT_COMPUTED;
+    segment->field = i;
+    segment->len = DEFAULT_BAR_WIDTH;
+    if (colon == NULL) return true;
+    if (!is_bar || len - name_len - 1 == 0 || len - name_len - 1 > 3) return false;
+
+    segment->len = 0;
+    for (const char* p = colon + 1; p < name + len; p++) {
+      if (!isdigit((unsigned char)*p)) return false;
+      segment->len = segment->len * 10 + (*p - '0');
+    }
+    return segment->len > 0 && segment->len <= MAX_BAR_WIDTH;
+  }
+  return false;
+}
+
+// Parses what is between {{ and }}: "key|filter:arg|...", "?key" or "/key".
+// Keys can also be computed placeholders, like "progress:20".
+// Returns false if it isn't any of those, so it can be kept as text.
+static bool parse_format_placeholder(const char* inner, size_t len, compiled_format_t* out, format_segment_t* segment_out)
+{
+  format_segment_t segment = {SEGMENT_FIELD, -1, out->filter_count, 0, 0, 0};
+  if (len > 0 && (inner[0] == '?' || inner[0] == '/')) {
+    segment.type = inner[0] == '?' ? SEGMENT_SECTION : SEGMENT_SECTION_END;
+    inner++;
+    len--;
+  }
+
+  const char* pipe = memchr(inner, '|', len);
+  size_t key_len = pipe == NULL ? len : (size_t)(pipe - inner);
+  const field_t* field = find_field(inner, key_len);
+  if (field != NULL) {
+    segment.field = field->id;
+  } else if (segment.type != SEGMENT_FIELD || !parse_computed_field(inner, key_len, &segment)) {
+    return false;
+  }
+  if (pipe != NULL && segment.type != SEGMENT_FIELD && segment.type != SEGMENT_COMPUTED) return false;
+
+  int filter_count = out->filter_count;
+  while (pipe != NULL) {
+    const char* filter = pipe + 1;
+    pipe = memchr(filter, '|', inner + len - filter);
+    size_t filter_len = (pipe == NULL ? inner + len : pipe) - filter;
+    if (filter_count == MAX_FORMAT_FILTERS || !parse_format_filter(filter, filter_len, &out->filters[filter_count])) return false;
+    filter_count++;
+  }
+
+  segment.filter_count = filter_count - out->filter_count;
+  out->filter_count = filter_count;
+  *segment_out = segment;
+  return true;
+}
+
+// Splits a format string into literal text, keys and sections once, so
+// rendering it is a single pass without searching for placeholders.
+static void compile_format(const char* format, compiled_format_t* out)
+{
+  memset(out, 0, sizeof(compiled_format_t));
+  out->source = format;
+  out->default_start = -1;
+
+  int sections[MAX_FORMAT_SECTIONS];
+  int section_depth = 0;
+  const char* literal = format;
+  const char* p = format;
+  while (*p != '\0') {
+    const char* open = strstr(p, "{{");
+    const char* close = open == NULL ? NULL : strstr(open + 2, "}}");
+    if (close == NULL) break;
+
+    format_segment_t segment;
+    bool is_default = strncmp(open, "{{default:", 10) == 0;
+    bool valid = is_default || parse_format_placeholder(open + 2, close - open - 2, out, &segment);
+    if (valid && !is_default && segment.type == SEGMENT_SECTION) {
+      valid = section_depth < MAX_FORMAT_SECTIONS;
+    } else if (valid && !is_default && segment.type == SEGMENT_SECTION_END) {
+      valid = section_depth > 0 && out->segments[sections[section_depth - 1]].field == segment.field;
+    }
+    // Text before the placeholder, the placeholder and the text after it have to fit
+    if (!valid || out->segment_count + 3 > MAX_FORMAT_SEGMENTS) {
+      // Not a key, or no room left for it, keep it as text
+      p = open + 2;
+      continue;
+    }
+
+    if (open > literal) {
+      out->segments[out->segment_count++] = (format_segment_t){SEGMENT_TEXT, -1, 0, 0, literal - format, open - literal};
+    }
+    if (is_default) {
+      out->default_start = open + 10 - format;
+      out->default_len = close - open - 10;
+    } else if (segment.type == SEGMENT_SECTION) {
+      sections[section_depth++] = out->segment_count;
+      out->segments[out->segment_count++] = segment;
+    } else {
+      if (segment.type == SEGMENT_SECTION_END) {
+        out->segments[sections[--section_depth]].start = out->segment_count;
+      } else if (segment.type == SEGMENT_COMPUTED && segment.field != COMPUTED_VOLUME_BAR) {
+        out->extrapolates = true;
+      }
+      out->segments[out->segment_count++] = segment;
+    }
+    literal = p = close + 2;
+  }
+
+  if (*literal != '\0') {
+    out->segments[out->segment_count++] = (format_segment_t){SEGMENT_TEXT, -1, 0, 0, literal - format, strlen(literal)};
+  }
+  // Sections that are never closed run to the end
+  while (section_depth > 0) {
+    out->segments[sections[--section_depth]].start = out->segment_count;
+  }
+}
+
+// Decodes the code point at p and returns the byte after it. Invalid bytes are taken one by one.
+static const char* decode_utf8(const char* p, uint32_t* code_point)
+{
+  unsigned char c = *p;
+  int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+  *code_point = len == 1 ? c : c & (0x3f >> (len - 1));
+  for (int i = 1; i < len; i++) {
+    if (((unsigned char)p[i] & 0xc0) != 0x80) {
+      *code_point = c;
+      return p + 1;
+    }
+    *code_point = (*code_point << 6) | (p[i] & 0x3f);
+  }
+  return p + len;
+}
+
+// Combining marks, variation selectors, skin tones and emoji tags belong to the character before them.
+static bool is_grapheme_extend(uint32_t code_point)
+{
+  return (code_point >= 0x300 && code_point <= 0x36f) || (code_point >= 0x1ab0 && code_point <= 0x1aff) ||
+         (code_point >= 0x1dc0 && code_point <= 0x1dff) || (code_point >= 0x20d0 && code_point <= 0x20ff) ||
+         (code_point >= 0xfe00 && code_point <= 0xfe0f) || (code_point >= 0xfe20 && code_point <= 0xfe2f) ||
+         (code_point >= 0x1f3fb && code_point <= 0x1f3ff) || (code_point >= 0xe0020 && code_point <= 0xe007f) ||
+         (code_point >= 0xe0100 && code_point <= 0xe01ef) || code_point == 0x200d;
+}
+
+// Returns the end of the user-perceived character at p. This is an
+// approximation of grapheme clusters: a character with the marks after it,
+// and anything joined to it with a zero width joiner.
+static const char* next_grapheme(const char* p)
+{
+  uint32_t code_point;
+  p = decode_utf8(p, &code_point);
+  while (*p != '\0') {
+    bool joined = code_point == 0x200d;
+    const char* next = decode_utf8(p, &code_point);
+    if (!joined && !is_grapheme_extend(code_point)) break;
+    p = next;
+  }
+  return p;
+}
+
+static size_t grapheme_length(const char* str)
+{
+  size_t length = 0;
+  for (const char* p = str; *p; p = next_grapheme(p)) {
+    length++;
+  }
+  return length;
+}
+
+// Returns the byte offset of the character at index, or the end of the string.
+static size_t grapheme_offset(const char* str, size_t index)
+{
+  const char* p = str;
+  for (size_t length = 0; *p && length < index; length++) {
+    p = next_grapheme(p);
+  }
+  return p - str;
+}
+
+// Appends the filtered text to out, which is then used as the input of the next filter.
+static void apply_format_filter(const format_filter_t* filter, const char* in, strbuf_t* out)
+{
+  size_t length = filter->type == FILTER_PAD || filter->type == FILTER_LPAD ? grapheme_length(in) : 0;
+  switch (filter->type) {
+    case FILTER_TRUNC:
+      // Cut to at most arg characters, ending in an ellipsis when something was cut
+      if (grapheme_length(in) <= (size_t)filter->arg) {
+        strbuf_append(out, in);
+      } else if (filter->arg > 0) {
+        strbuf_append_len(out, in, grapheme_offset(in, filter->arg - 1));
+        strbuf_append(out, "…");
+      }
+      break;
+    case FILTER_PAD:
+    case FILTER_LPAD:
+      if (filter->type == FILTER_PAD) strbuf_append(out, in);
+      for (; length < (size_t)filter->arg; length++) {
+        strbuf_append_len(out, " ", 1);
+      }
+      if (filter->type == FILTER_LPAD) strbuf_append(out, in);
+      break;
+    case FILTER_UPPER:
+    case FILTER_LOWER:
+      // Only ASCII letters change, so multi-byte characters stay intact
+      strbuf_append(out, in);
+      for (char* p = out->data + out->len - strlen(in); *p; p++) {
+        *p = filter->type == FILTER_UPPER ? toupper((unsigned char)*p) : tolower((unsigned char)*p);
+      }
+      break;
+    case FILTER_ESCAPE_PANGO:
+    case FILTER_ESCAPE_JSON:
+      for (const char* p = in; *p; p++) {
+        const char* escaped = NULL;
+        char code[8];
+        if (filter->type == FILTER_ESCAPE_PANGO) {
+          escaped = *p == '&' ? "&amp;" : *p == '<' ? "&lt;" : *p == '>' ? "&gt;" : *p == '\'' ? "&#39;" : *p == '"' ? "&quot;" : NULL;
+        } else if (*p == '"' || *p == '\\') {
+          snprintf(code, sizeof(code), "\\%c", *p);
+          escaped = code;
+        } else if ((unsigned char)*p < 0x20) {
+          snprintf(code, sizeof(code), "\\u%04x", (unsigned char)*p);
+          escaped = code;
+        }
+        if (escaped == NULL) {
+          strbuf_append_len(out, p, 1);
+        } else {
+          strbuf_append(out, escaped);
+        }
+      }
+      break;
+  }
+}
+
+// Sections are shown when their key has a value: a non-empty string, true or a non-zero number.
+static bool is_field_set(const wnp_player_t* player, int field)
+{
+  char scratch[WNP_STR_LEN] = {0};
+  field_value_t value = g_fields[field].get(player, scratch);
+  if (value.type == FIELD_STRING || value.type == FIELD_ENUM) {
+    return value.string[0] != '\0';
+  }
+  return value.number != 0;
+}
+
+// libwnp only reports the position every now and then, in between it
+// advances by the time passed since the last update while playing.
+static int get_extrapolated_position(const wnp_player_t* player, long long now)
+{
+  if (player->state != WNP_STATE_PLAYING || player->duration <= 0 || now <= player->updated_at) {
+    return player->position;
+  }
+  long long position = player->position + (now - player->updated_at) / 1000;
+  return position < player->duration ? (int)position : player->duration;
+}
+
+// Returns when the extrapolated position of the player goes up by a second,
+// or 0 if it doesn't, because it isn't playing or is at the end.
+static long long get_position_tick_at(const wnp_player_t* player, long long now)
+{
+  if (player->id == -1 || player->state != WNP_STATE_PLAYING || get_extrapolated_position(player, now) >= player->duration) {
+    return 0;
+  }
+  long long elapsed = now > player->updated_at ? now - player->updated_at : 0;
+  return player->updated_at + (elapsed / 1000 + 1) * 1000;
+}
+
+static void append_bar(strbuf_t* out, int width, long long value, long long max)
+{
+  int filled = max > 0 ? (int)(value * width / max) : 0;
+  if (filled > width) filled = width;
+  if (filled < 0) filled = 0;
+
+  for (int i = 0; i < width; i++) {
+    strbuf_append(out, i < filled ? "█" : "░");
+  }
+}
+
+static void render_computed(const format_segment_t* segment, const wnp_player_t* player, long long now, strbuf_t* out)
+{
+  int position = get_extrapolated_position(player, now);
+  char value[16];
+  switch (segment->field) {
+    case COMPUTED_PROGRESS:
+      append_bar(out, segment->len, position, player->duration);
+      break;
+    case COMPUTED_PERCENT:
+      snprintf(value, sizeof(value), "%d", player->duration > 0 ? position * 100 / player->duration : 0);
+      strbuf_append(out, value);
+      break;
+    case COMPUTED_REMAINING:
+      wnp_format_seconds(player->duration > position ? player->duration - position : 0, false, value);
+      strbuf_append(out, value);
+      break;
+    case COMPUTED_VOLUME_BAR:
+      append_bar(out, segment->len, player->volume, 100);
+      break;
+  }
+}
+
+// Appends the rendered format to out. Filters are applied back and forth
+// between the two scratch buffers, which are reused across renders.
+// Players that don't exist get the {{default:...}} text instead, if the format has one.
+static void render_format(const compiled_format_t* format, const wnp_player_t* player, strbuf_t* out, strbuf_t scratch[2])
+{
+  if (format->default_start != -1 && player->id == -1) {
+    strbuf_append_len(out, format->source + format->default_start, format->default_len);
+    return;
+  }
+
+  long long now = format->extrapolates ? get_wall_time_ms() : 0;
+  for (int i = 0; i < format->segment_count; i++) {
+    const format_segment_t* segment = &format->segments[i];
+    if (segment->type == SEGMENT_TEXT) {
+      strbuf_append_len(out, format->source + segment->start, segment->len);
+    } else if (segment->type == SEGMENT_SECTION && !is_field_set(player, segment->field)) {
+      i = segment->start;
+    } else if (segment->type == SEGMENT_FIELD || segment->type == SEGMENT_COMPUTED) {
+      strbuf_t* value = segment->filter_count == 0 ? out : &scratch[0];
+      if (value != out) strbuf_clear(value);
+      if (segment->type == SEGMENT_FIELD) {
+        char text[FIELD_VALUE_LEN];
+        format_field(player, segment->field, text);
+        strbuf_append(value, text);
+      } else {
+        render_computed(segment, player, now, value);
+      }
+      for (int f = 0; f < segment->filter_count; f++) {
+        strbuf_t* filtered = &scratch[(f + 1) % 2];
+        strbuf_clear(filtered);
+        // A filter can leave nothing in a scratch buffer that was never grown, whose data is still NULL
+        apply_format_filter(&format->filters[segment->first_filter + f], strbuf_str(value), filtered);
+        value = filtered;
+      }
+      if (value != out) strbuf_append_len(out, strbuf_str(value), value->len);
+    }
+  }
+}
+
+static const compiled_format_t* get_compiled_format(client_state_t* state, int index)
+{
+  if (state->formats[index] == NULL) {
+    const char* source = index == 0 ? state->arguments.format : strchr(state->arguments.named_formats[index - 1], '=') + 1;
+    state->formats[index] = arena_alloc(state->arena, sizeof(compiled_format_t));
+    compile_format(source, state->formats[index]);
+  }
+  return state->formats[index];
+}
+
+static void compute_metadata(client_state_t* state, const wnp_player_t* player)
+{
+  if (state->arguments.encoding != ENCODING_TEXT && state->arguments.named_format_count == 0 && state->arguments.format[0] == '\0') {
+    strbuf_clear(&state->encoded_output);
+    if (state->arguments.encoding == ENCODING_BINARY) {
+      write_player_binary(&state->encoded_output, player, state->arguments.command_arg, state->render_fields);
+    } else {
+      write_player_json(&state->encoded_output, player, state->arguments.command_arg, state->render_fields);
+    }
+    return;
+  }
+
+  // Named formats are all rendered into one frame, one NAME=OUTPUT line each,
+  // or one object with a member per name for --json.
+  if (state->arguments.named_format_count > 0) {
+    json_writer_t writer = {0};
+    if (state->arguments.encoding == ENCODING_JSON) {
+      strbuf_clear(&state->encoded_output);
+      json_begin(&writer, &state->encoded_output, "{");
+    }
+    strbuf_clear(&state->response);
+    for (int i = 0; i < state->arguments.named_format_count; i++) {
+      const char* named = state->arguments.named_formats[i];
+      const char* separator = strchr(named, '=');
+      if (state->arguments.encoding == ENCODING_JSON) {
+        char name[sizeof(state->arguments.named_formats[0])];
+        snprintf(name, sizeof(name), "%.*s", (int)(separator - named), named);
+        strbuf_clear(&state->format_output);
+        render_format(get_compiled_format(state, i + 1), player, &state->format_output, state->filter_scratch);
+        json_add_string(&writer, name, strbuf_str(&state->format_output));
+        continue;
+      }
+      strbuf_printf(&state->response, "%s%.*s=", i > 0 ? "\n" : "", (int)(separator - named), named);
+      render_format(get_compiled_format(state, i + 1), player, &state->response, state->filter_scratch);
+    }
+    if (state->arguments.encoding == ENCODING_JSON) {
+      json_end(&writer, "}");
+    }
+    return;
+  }
+
+  if (strlen(state->arguments.format) > 0) {
+    strbuf_clear(&state->response);
+    render_format(get_compiled_format(state, 0), player, &state->response, state->filter_scratch);
+    if (state->arguments.encoding == ENCODING_JSON) {
+      json_writer_t writer;
+      strbuf_clear(&state->encoded_output);
+      json_begin(&writer, &state->encoded_output, "{");
+      json_add_string(&writer, "output", strbuf_str(&state->response));
+      json_end(&writer, "}");
+    }
+    return;
+  }
+
+  if (state->arguments.command_arg != METADATA_ALL) {
+    char value[FIELD_VALUE_LEN];
+    format_field(player, state->arguments.command_arg, value);
+    strbuf_clear(&state->response);
+    strbuf_append(&state->response, value);
+    return;
+  }
+
+  // Delta followers only get the fields that changed since their last update
+  strbuf_clear(&state->response);
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    if (state->render_fields & g_fields[i].dirty_bit) {
+      char value[FIELD_VALUE_LEN];
+      format_field(player, i, value);
+      append_response(state, g_fields[i].name, value);
+    }
+  }
+}
+
+// $XDG_CONFIG_HOME/wnpcli/views.conf, or ~/.config/wnpcli/views.conf without it.
+// %APPDATA%/wnpcli/views.conf on windows. NULL if neither is set.
+static const char* get_views_path()
+{
+  static char path[512] = "";
+  if (path[0] != '\0') return path;
+
+#ifdef _WIN32
+  const char* app_data = getenv("APPDATA");
+  if (app_data == NULL) return NULL;
+  snprintf(path, sizeof(path), "%s/wnpcli/views.conf", app_data);
+#else
+  const char* config_home = getenv("XDG_CONFIG_HOME");
+  const char* home = getenv("HOME");
+  if (config_home != NULL && config_home[0] != '\0') {
+    snprintf(path, sizeof(path), "%s/wnpcli/views.conf", config_home);
+  } else if (home != NULL) {
+    snprintf(path, sizeof(path), "%s/.config/wnpcli/views.conf", home);
+  } else {
+    return NULL;
+  }
+#endif
+  return path;
+}
+
+// Splits the options of a view in place, on whitespace outside of single
+// or double quotes. Inside double quotes, \" and \\ are unescaped.
+// Returns the number of arguments, or -1 for an unclosed quote or too many.
+#define MAX_VIEW_ARGS 32
+static int split_view_args(char* options, char* argv[MAX_VIEW_ARGS])
+{
+  int argc = 0;
+  char* p = options;
+  while (true) {
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') return argc;
+    if (argc == MAX_VIEW_ARGS) return -1;
+
+    char* out = p;
+    char quote = '\0';
+    argv[argc++] = out;
+    while (*p != '\0' && (quote != '\0' || !isspace((unsigned char)*p))) {
+      if (quote == '\0' && (*p == '\'' || *p == '"')) {
+        quote = *p++;
+      } else if (*p == quote) {
+        quote = '\0';
+        p++;
+      } else if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+        *out++ = p[1];
+        p += 2;
+      } else {
+        *out++ = *p++;
+      }
+    }
+    if (quote != '\0') return -1;
+
+    bool end = *p == '\0';
+    *out = '\0';
+    if (end) return argc;
+    p++;
+  }
+}
+
+static void release_view(view_t* view)
+{
+  if (view == NULL || thread_atomic_int_dec(&view->refcount) != 1) return;
+
+  thread_mutex_term(&view->render_lock);
+  strbuf_free(&view->render_response);
+  strbuf_free(&view->render_encoded);
+  free(view);
+}
+
+// Parses the options of a view the same way as a command line and compiles
+// its formats. Returns NULL if they are invalid, after printing why.
+static view_t* create_view(const char* name, char* options)
+{
+  char* argv[1 + MAX_VIEW_ARGS] = {"wnpcli"};
+  int argc = split_view_args(options, argv + 1);
+  if (argc == -1) {
+    printf("Too many options or an unclosed quote\n");
+    return NULL;
+  }
+
+  view_t* view = calloc(1, sizeof(view_t));
+  if (view == NULL) return NULL;
+  if (!parse_arguments(1 + argc, argv, true, &view->arguments)) {
+    free(view);
+    return NULL;
+  }
+
+  strcpy(view->name, name);
+  if (view->arguments.format[0] != '\0') {
+    compile_format(view->arguments.format, &view->formats[0]);
+  }
+  for (int i = 0; i < view->arguments.named_format_count; i++) {
+    compile_format(strchr(view->arguments.named_formats[i], '=') + 1, &view->formats[i + 1]);
+  }
+  for (int i = 0; i < 1 + MAX_NAMED_FORMATS; i++) {
+    view->extrapolates = view->extrapolates || view->formats[i].extrapolates;
+  }
+  thread_atomic_int_store(&view->refcount, 1);
+  thread_mutex_init(&view->render_lock);
+  view->render_version = -1;
+  return view;
+}
+
+// Replaces all views with the ones in the file at path, or none if it is NULL.
+// Lines are "NAME = OPTIONS", empty ones and those starting with # are skipped.
+// Views that don't parse are reported and left out. Called with g_view_lock held.
+static void load_views(const char* path)
+{
+  view_t* views[MAX_VIEWS];
+  int count = 0;
+  FILE* file = path != NULL ? fopen(path, "r") : NULL;
+  char line[4096];
+
+  for (int number = 1; file != NULL && fgets(line, sizeof(line), file) != NULL; number++) {
+    char* name = line;
+    while (isspace((unsigned char)*name)) name++;
+    if (*name == '\0' || *name == '#') continue;
+
+    char* separator = strchr(name, '=');
+    char* name_end = separator != NULL ? separator : name;
+    while (name_end > name && isspace((unsigned char)name_end[-1])) name_end--;
+    if (name_end == name || name_end - name >= VIEW_NAME_LEN) {
+      printf("%s:%d: Has to be NAME = OPTIONS, with a name of at most %d characters\n", path, number, VIEW_NAME_LEN - 1);
+      continue;
+    }
+    *name_end = '\0';
+
+    bool duplicate = false;
+    for (int i = 0; i < count; i++) {
+      duplicate = duplicate || strcmp(views[i]->name, name) == 0;
+    }
+    if (duplicate || count == MAX_VIEWS) {
+      printf("%s:%d: %s\n", path, number, duplicate ? "There already is a view with this name" : "Too many views");
+      continue;
+    }
+
+    view_t* view = create_view(name, separator + 1);
+    if (view == NULL) {
+      printf("%s:%d: Skipping view %s\n", path, number, name);
+      continue;
+    }
+    views[count++] = view;
+  }
+
+  if (file != NULL) {
+    fclose(file);
+    printf("Loaded %d views from %s\n", count, path);
+    fflush(stdout);
+  }
+  for (int i = 0; i < g_view_count; i++) {
+    release_view(g_views[i]);
+  }
+  memcpy(g_views, views, count * sizeof(view_t*));
+  g_view_count = count;
+}
+
+// Views are reloaded once the modification time or size of the file changed,
+// which is cheap enough to check on every view request. Called with g_view_lock held.
+static void reload_views_if_changed()
+{
+  const char* path = get_views_path();
+  struct stat info;
+  bool exists = path != NULL && stat(path, &info) == 0;
+  time_t mtime = exists ? info.st_mtime : 0;
+  long long size = exists ? (long long)info.st_size : -1;
+  if (mtime == g_views_mtime && size == g_views_size) return;
+
+  g_views_mtime = mtime;
+  g_views_size = size;
+  load_views(exists ? path : NULL);
+}
+
+// Returns a reference to the view with that name, which the caller has to release, or NULL.
+static view_t* acquire_view(const char* name)
+{
+  view_t* view = NULL;
+  thread_mutex_lock(&g_view_lock);
+  reload_views_if_changed();
+  for (int i = 0; i < g_view_count && view == NULL; i++) {
+    if (strcmp(g_views[i]->name, name) == 0) {
+      view = g_views[i];
+      thread_atomic_int_inc(&view->refcount);
+    }
+  }
+  thread_mutex_unlock(&g_view_lock);
+  return view;
+}
+
+// Turns a view request into the request the view stands for. Only --follow
+// and --max-rate are kept from the client. Returns false if there is no such view.
+static bool attach_view(client_state_t* state)
+{
+  view_t* view = acquire_view(state->arguments.view);
+  if (view == NULL) return false;
+
+  bool follow = state->arguments.follow;
+  int max_rate = state->arguments.max_rate;
+  state->arguments = view->arguments;
+  state->arguments.follow = follow;
+  state->arguments.max_rate = max_rate;
+  state->view = view;
+  if (view->arguments.format[0] != '\0') {
+    state->formats[0] = &view->formats[0];
+  }
+  for (int i = 0; i < view->arguments.named_format_count; i++) {
+    state->formats[i + 1] = &view->formats[i + 1];
+  }
+  return true;
+}
+
+// Every follower of a view renders the same output for the same player in
+// the same snapshot, so the first one renders it and the others copy it.
+// Extrapolated placeholders also depend on the position at render time.
+static void compute_view_metadata(client_state_t* state, player_snapshot_t* snapshot, const wnp_player_t* player)
+{
+  view_t* view = state->view;
+  int position = view->extrapolates ? get_extrapolated_position(player, get_wall_time_ms()) : 0;
+
+  thread_mutex_lock(&view->render_lock);
+  if (view->render_version != snapshot->version || view->render_player_id != player->id || view->render_position != position) {
+    compute_metadata(state, player);
+    strbuf_clear(&view->render_response);
+    strbuf_append_len(&view->render_response, strbuf_str(&state->response), state->response.len);
+    strbuf_clear(&view->render_encoded);
+    strbuf_append_len(&view->render_encoded, strbuf_str(&state->encoded_output), state->encoded_output.len);
+    view->render_version = snapshot->version;
+    view->render_player_id = player->id;
+    view->render_position = position;
+  } else {
+    strbuf_clear(&state->response);
+    strbuf_append_len(&state->response, strbuf_str(&view->render_response), view->render_response.len);
+    strbuf_clear(&state->encoded_output);
+    strbuf_append_len(&state->encoded_output, strbuf_str(&view->render_encoded), view->render_encoded.len);
+  }
+  thread_mutex_unlock(&view->render_lock);
+}
+
+static uint32_t hash_bytes(const char* data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void append_table_line(strbuf_t* out, const char* event, const char* id, const strbuf_t* render, int encoding)
+{
+  if (encoding == ENCODING_BINARY) {
+    // Binary renders already are a whole player record
+    if (render != NULL) {
+      strbuf_append_len(out, render->data, render->len);
+    } else {
+      binary_append_varint(out, BINARY_REMOVED);
+      binary_append_string(out, id);
+    }
+    return;
+  }
+
+  if (out->len > 0) strbuf_append(out, "\n");
+  if (encoding == ENCODING_JSON) {
+    json_writer_t writer;
+    json_begin(&writer, out, "{");
+    if (event != NULL) json_add_string(&writer, "event", event);
+    json_add_string(&writer, "id", id);
+    if (render != NULL) json_add_raw(&writer, "player", render->data);
+    json_end(&writer, "}");
+    return;
+  }
+  if (event != NULL) {
+    strbuf_append(out, event);
+    strbuf_append(out, " ");
+  }
+  strbuf_append(out, id);
+  if (render != NULL) {
+    strbuf_append(out, " ");
+    strbuf_append(out, render->data);
+  }
+}
+
+static bool is_table_request(client_state_t* state)
+{
+  return state->arguments.list_all || (state->arguments.player_id == PLAYER_ID_ALL && state->arguments.command == COMMAND_METADATA);
+}
+
+// With --on, followers only care about changes to some fields. Compares the
+// player against the snapshot the follower saw last.
+static bool watched_fields_changed(client_state_t* state, const wnp_player_t* player)
+{
+  if (state->arguments.on_fields == 0 || state->seen_snapshot == NULL) return true;
+  const wnp_player_t* seen = snapshot_get_player(state->seen_snapshot, player->id);
+  return seen == NULL || (diff_players(seen, player) & state->arguments.on_fields) != 0;
+}
+
+// Fields to send a delta follower for the player: everything the first time
+// the follower sees it, afterwards what changed since the last snapshot.
+static uint32_t get_delta_fields(client_state_t* state, const wnp_player_t* player, bool known)
+{
+  const wnp_player_t* seen = state->seen_snapshot == NULL ? NULL : snapshot_get_player(state->seen_snapshot, player->id);
+  if (!known || seen == NULL) return ALL_FIELDS;
+  return diff_players(seen, player);
+}
+
+static bool state_extrapolates(client_state_t* state)
+{
+  for (int i = 0; i < 1 + MAX_NAMED_FORMATS; i++) {
+    if (state->formats[i] != NULL && state->formats[i]->extrapolates) return true;
+  }
+  return false;
+}
+
+// Keeps the last rendered snapshot around for followers that diff against
+// it, or re-render from it as their progress placeholders move on.
+static void set_seen_snapshot(client_state_t* state, player_snapshot_t* snapshot)
+{
+  bool keep = state->arguments.on_fields != 0 || state->arguments.delta || state->arguments.scroll_width > 0 || state_extrapolates(state);
+  if (!keep || state->seen_snapshot == snapshot) return;
+  thread_atomic_int_inc(&snapshot->refcount);
+  if (state->seen_snapshot != NULL) {
+    release_snapshot(state->seen_snapshot);
+  }
+  state->seen_snapshot = snapshot;
+}
+
+// Renders every player (matching the -p all: query, if any) and appends an
+// "added", "changed" or "removed" line to stream_output for each difference to
+// what the follower was last told. Unchanged players aren't rendered again.
+// --list-all starts out with plain "<id> <output>" lines instead, where the
+// output is just the name unless a format was given.
+// Returns whether anything was appended.
+static bool compute_player_table(client_state_t* state, player_snapshot_t* snapshot)
+{
+  if (state->table == NULL) {
+    state->table = arena_alloc(state->arena, sizeof(player_table_t));
+  }
+  player_table_t* table = state->table;
+  int encoding = state->arguments.encoding;
+  bool render_name = state->arguments.list_all && state->arguments.format[0] == '\0' && encoding == ENCODING_TEXT;
+  const char* added = state->arguments.list_all && !table->listed ? NULL : "added";
+  size_t output_len = state->stream_output.len;
+  bool present[WNP_MAX_PLAYERS] = {0};
+
+  for (int i = 0; i < snapshot->count; i++) {
+    const wnp_player_t* player = &snapshot->players[i];
+    int id = player->id;
+    if (id < 0 || id >= WNP_MAX_PLAYERS) continue;
+
+    if (table->known[id] && state->arguments.on_fields == 0 && table->seen_updated_at[id] == player->updated_at) {
+      present[id] = true;
+      continue;
+    }
+
+    table->seen_updated_at[id] = player->updated_at;
+    if (state->predicate != NULL && !predicate_matches(state->predicate, player)) continue;
+    present[id] = true;
+    if (table->known[id] && !watched_fields_changed(state, player)) continue;
+
+    // A read-only view of whatever was rendered, binary renders can contain zeros.
+    strbuf_t render = {.data = (char*)player->name, .len = strlen(player->name)};
+    if (state->arguments.delta) {
+      state->render_fields = get_delta_fields(state, player, table->known[id]);
+    }
+    if (!render_name && encoding != ENCODING_TEXT) {
+      compute_metadata(state, player);
+      render = state->encoded_output;
+    } else if (!render_name) {
+      compute_metadata(state, player);
+      render = (strbuf_t){.data = (char*)strbuf_str(&state->response), .len = state->response.len};
+    }
+    uint32_t hash = hash_bytes(render.data, render.len);
+    if (table->known[id] && table->render_hash[id] == hash && (render_name || !state->arguments.delta)) continue;
+
+    char formatted_id[WNP_STR_LEN] = {0};
+    get_formatted_id(player, formatted_id);
+    strcpy(table->ids[id], formatted_id);
+    append_table_line(&state->stream_output, table->known[id] ? "changed" : added, table->ids[id], &render, encoding);
+    table->known[id] = true;
+    table->render_hash[id] = hash;
+  }
+
+  for (int id = 0; id < WNP_MAX_PLAYERS; id++) {
+    if (table->known[id] && !present[id]) {
+      append_table_line(&state->stream_output, "removed", table->ids[id], NULL, encoding);
+      table->known[id] = false;
+    }
+  }
+
+  table->listed = true;
+  return state->stream_output.len != output_len;
+}
+
+// Runs an action command against one player. Returns the libwnp event id, or -1.
+static int try_command(client_state_t* state, wnp_player_t* player)
+{
+  switch (state->arguments.command) {
+    case COMMAND_SET_STATE:
+      return wnp_try_set_state(player, state->arguments.command_arg);
+    case COMMAND_SKIP_PREVIOUS:
+      return wnp_try_skip_previous(player);
+    case COMMAND_SKIP_NEXT:
+      return wnp_try_skip_next(player);
+    case COMMAND_SET_POSITION:
+      if (state->arguments.flags & RELATIVE_POSITION_PLUS) {
+        return wnp_try_forward(player, state->arguments.command_arg);
+      } else if (state->arguments.flags & RELATIVE_POSITION_MINUS) {
+        return wnp_try_revert(player, state->arguments.command_arg);
+      } else {
+        return wnp_try_set_position(player, state->arguments.command_arg);
+      }
+    case COMMAND_SET_VOLUME:
+      if (state->arguments.flags & RELATIVE_POSITION_PLUS) {
+        return wnp_try_set_volume(player, player->volume + state->arguments.command_arg);
+      } else if (state->arguments.flags & RELATIVE_POSITION_MINUS) {
+        return wnp_try_set_volume(player, player->volume - state->arguments.command_arg);
+      } else {
+        return wnp_try_set_volume(player, state->arguments.command_arg);
+      }
+    case COMMAND_SET_RATING:
+      return wnp_try_set_rating(player, state->arguments.command_arg);
+    case COMMAND_SET_REPEAT:
+      return wnp_try_set_repeat(player, state->arguments.command_arg);
+    case COMMAND_SET_SHUFFLE:
+      return wnp_try_set_shuffle(player, state->arguments.command_arg);
+    case COMMAND_PLAY_PAUSE:
+      return wnp_try_play_pause(player);
+    case COMMAND_TOGGLE_REPEAT:
+      return wnp_try_toggle_repeat(player);
+  }
+
+  return -1;
+}
+
+// Runs the command on every player (matching the -p all: query, if any) and
+// answers with one "<id> <result>" line per player.
+static void compute_fan_out(client_state_t* state, player_snapshot_t* snapshot)
+{
+  const wnp_player_t* targets[WNP_MAX_PLAYERS];
+  int event_ids[WNP_MAX_PLAYERS];
+  int count = 0;
+
+  for (int i = 0; i < snapshot->count; i++) {
+    if (state->predicate != NULL && !predicate_matches(state->predicate, &snapshot->players[i])) continue;
+    wnp_player_t player = snapshot->players[i];
+    targets[count] = &snapshot->players[i];
+    event_ids[count++] = try_command(state, &player);
+  }
+
+  state->should_close = true;
+  strbuf_clear(&state->response);
+  if (count == 0) {
+    strbuf_append(&state->response, "No player matched");
+    return;
+  }
+
+  // Only wait once every event was sent, so the players handle them in parallel.
+  char* responses[] = {"PENDING", "SUCCEEDED", "FAILED"};
+  for (int i = 0; i < count; i++) {
+    char formatted_id[WNP_STR_LEN] = {0};
+    get_formatted_id(targets[i], formatted_id);
+    if (event_ids[i] == -1) {
+      strbuf_printf(&state->response, "%s%s FAILED", i == 0 ? "" : "\n", formatted_id);
+    } else if (state->arguments.wait) {
+      strbuf_printf(&state->response, "%s%s %s", i == 0 ? "" : "\n", formatted_id, responses[wnp_wait_for_event_result(event_ids[i])]);
+    } else {
+      strbuf_printf(&state->response, "%s%s %d", i == 0 ? "" : "\n", formatted_id, event_ids[i]);
+    }
+  }
+}
+
+#define SCROLL_GAP "   "
+
+// Replaces the response with the --scroll window into it. The window moves
+// by a character every 1/scroll-rate seconds while playing, driven by
+// tick_shard, and starts over on a new track.
+static void scroll_response(client_state_t* state, const wnp_player_t* player)
+{
+  long long now = get_wall_time_ms();
+  long long period = 1000 / state->arguments.scroll_rate;
+  size_t width = state->arguments.scroll_width;
+  uint32_t track = player->id ^ hash_bytes(player->title, strlen(player->title)) ^ hash_bytes(player->artist, strlen(player->artist)) ^
+                   hash_bytes(player->album, strlen(player->album));
+
+  if (grapheme_length(strbuf_str(&state->response)) <= width) {
+    state->scroll_length = 0;
+    return;
+  }
+
+  strbuf_clear(&state->scroll_text);
+  strbuf_append_len(&state->scroll_text, state->response.data, state->response.len);
+  strbuf_append(&state->scroll_text, SCROLL_GAP);
+  const char* text = state->scroll_text.data;
+  size_t length = grapheme_length(text);
+  if (state->scroll_length == 0 || track != state->scroll_track) {
+    state->scroll_offset = 0;
+    state->scroll_next_at = now + period;
+  } else if (player->state != WNP_STATE_PLAYING) {
+    state->scroll_next_at = now + period;
+  } else if (now >= state->scroll_next_at) {
+    state->scroll_offset++;
+    state->scroll_next_at += period;
+    if (state->scroll_next_at <= now) state->scroll_next_at = now + period;
+  }
+  state->scroll_offset %= length;
+  state->scroll_length = length;
+  state->scroll_track = track;
+
+  // Wraps around to the start of the text after the gap
+  const char* p = text + grapheme_offset(text, state->scroll_offset);
+  strbuf_clear(&state->response);
+  for (size_t i = 0; i < width; i++) {
+    if (*p == '\0') p = text;
+    const char* next = next_grapheme(p);
+    strbuf_append_len(&state->response, p, next - p);
+    p = next;
+  }
+}
+
+// Reports the memory held by connections and snapshots in total, followed by
+// what every follower holds in its arena.
+static void compute_stats(client_state_t* state)
+{
+  strbuf_t* followers = &state->format_output;
+  int follower_count = 0;
+  strbuf_clear(followers);
+  for (int i = 0; i < g_shard_count; i++) {
+    thread_mutex_lock(&g_shards[i].lock);
+    for (int j = 0; j < MAX_STATES; j++) {
+      client_state_t* follower = g_shards[i].states[j];
+      if (follower == NULL) continue;
+      strbuf_printf(followers, "%-30s %zu\n", "follower", follower->arena->reserved);
+      follower_count++;
+    }
+    thread_mutex_unlock(&g_shards[i].lock);
+  }
+
+  char value[32];
+  strbuf_clear(&state->response);
+  snprintf(value, sizeof(value), "%d", thread_atomic_int_load(&g_connection_count));
+  append_response(state, "connections", value);
+  snprintf(value, sizeof(value), "%d", follower_count);
+  append_response(state, "followers", value);
+  snprintf(value, sizeof(value), "%zu", arena_get_total_reserved());
+  append_response(state, "connection-bytes", value);
+  snprintf(value, sizeof(value), "%zu", thread_atomic_int_load(&g_snapshot_count) * sizeof(player_snapshot_t));
+  append_response(state, "snapshot-bytes", value);
+  strbuf_append_len(&state->response, strbuf_str(followers), followers->len);
+  state->should_close = true;
+}
+
+static void compute_state(client_state_t* state, player_snapshot_t* snapshot)
+{
+  bool has_query = (state->arguments.player_id == PLAYER_ID_QUERY && strpbrk(state->arguments.player_query, "=~!") != NULL) ||
+                   (state->arguments.player_id == PLAYER_ID_ALL && state->arguments.player_query[0] != '\0');
+  if (has_query && state->predicate == NULL) {
+    player_predicate_t* predicate = arena_alloc(state->arena, sizeof(player_predicate_t));
+    if (!parse_predicate(state->arguments.player_query, predicate)) {
+      strbuf_clear(&state->response);
+      strbuf_printf(&state->response, "Invalid player query: %s", state->arguments.player_query);
+      state->should_close = true;
+      return;
+    }
+    state->predicate = predicate;
+  }
+
+  if (state->arguments.player_id == PLAYER_ID_ALL && state->arguments.command >= COMMAND_SET_STATE &&
+      state->arguments.command <= COMMAND_TOGGLE_REPEAT) {
+    compute_fan_out(state, snapshot);
+    return;
+  }
+
+  if (is_table_request(state)) {
+    compute_player_table(state, snapshot);
+    state->should_close = !state->arguments.follow;
+    return;
+  }
+
+  if (state->arguments.command == COMMAND_EVENTS) {
+    // Events are queued by broadcast_event, there's nothing to answer with up front.
+    return;
+  }
+
+  const wnp_player_t* resolved = get_player_from_state(state, snapshot);
+  if (state->arguments.command == COMMAND_METADATA) {
+    if (state->view != NULL && !state->arguments.delta) {
+      compute_view_metadata(state, snapshot, resolved);
+    } else {
+      compute_metadata(state, resolved);
+    }
+    if (state->arguments.scroll_width > 0) {
+      scroll_response(state, resolved);
+    }
+    state->should_close = !state->arguments.follow;
+    return;
+  }
+
+  // libwnp takes a mutable player, so commands get their own copy of the shared one.
+  wnp_player_t player = *resolved;
+  int event_id = -1;
+
+  switch (state->arguments.command) {
+    case COMMAND_STOP_DAEMON:
+      // Need to send the messages in here instead of after compute_state
+      // since we stop the daemon here.
+      printf("Received stop-daemon. Stopping...\n");
+      send_message(state->client_fd, "Daemon stopped.");
+      signal_handler(SIGTERM);
+      break;
+    case COMMAND_SET_STATE:
+    case COMMAND_SKIP_PREVIOUS:
+    case COMMAND_SKIP_NEXT:
+    case COMMAND_SET_POSITION:
+    case COMMAND_SET_VOLUME:
+    case COMMAND_SET_RATING:
+    case COMMAND_SET_REPEAT:
+    case COMMAND_SET_SHUFFLE:
+    case COMMAND_PLAY_PAUSE:
+    case COMMAND_TOGGLE_REPEAT:
+      event_id = try_command(state, &player);
+      break;
+    case COMMAND_STATS:
+      compute_stats(state);
+      break;
+    case COMMAND_SELECT_ACTIVE:
+      g_selected_player_id = PLAYER_ID_ACTIVE;
+      strbuf_clear(&state->response);
+      strbuf_append(&state->response, "Selected the active player");
+      state->should_close = true;
+      break;
+    case COMMAND_SELECT_PREVIOUS:
+    case COMMAND_SELECT_NEXT: {
+      bool recent = state->arguments.command_arg == SELECT_ORDER_RECENT;
+      int selected_id = state->arguments.command == COMMAND_SELECT_NEXT ? player_index_next(player.id, recent) : player_index_previous(player.id, recent);
+      const wnp_player_t* selected = snapshot_get_player(snapshot, selected_id);
+
+      state->should_close = true;
+      strbuf_clear(&state->response);
+      if (selected == NULL || selected_id == player.id) {
+        strbuf_append(&state->response, "No player to select was found");
+      } else {
+        g_selected_player_id = selected_id;
+        char formatted_id[WNP_STR_LEN] = {0};
+        get_formatted_id(selected, formatted_id);
+        strbuf_printf(&state->response, "Selected player %s", formatted_id);
+      }
+      break;
+    }
+  }
+
+  if (event_id != -1) {
+    strbuf_clear(&state->response);
+    if (state->arguments.wait) {
+      wnp_event_result_t result = wnp_wait_for_event_result(event_id);
+      char* responses[] = {"PENDING", "SUCCEEDED", "FAILED"};
+      strbuf_append(&state->response, responses[result]);
+      state->should_close = true;
+      return;
+    } else {
+      strbuf_printf(&state->response, "%d", event_id);
+      state->should_close = true;
+      return;
+    }
+  }
+}
+
+static int get_core_count()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int count = (int)info.dwNumberOfProcessors;
+#else
+  int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (count < 1) return 1;
+  if (count > MAX_SHARDS) return MAX_SHARDS;
+  return count;
+}
+
+// sent is what the first output took, it is charged like every later one.
+static void reset_follow_limits(client_state_t* state, long long now, size_t sent)
+{
+  state->send_pending = false;
+  state->last_sent_at = now;
+  state->tokens = FOLLOW_BURST_BYTES - (double)sent;
+  state->tokens_updated_at = now;
+}
+
+// Returns the time at which the follower may be sent to next. A message can
+// overdraw the bucket, the follower then waits until it is paid back.
+static long long get_follow_deadline(client_state_t* state, long long now)
+{
+  state->tokens += (now - state->tokens_updated_at) * FOLLOW_BYTES_PER_SEC / 1000.0;
+  if (state->tokens > FOLLOW_BURST_BYTES) state->tokens = FOLLOW_BURST_BYTES;
+  state->tokens_updated_at = now;
+
+  long long deadline = now;
+  if (state->tokens < 0) {
+    deadline = now + (long long)(-state->tokens * 1000 / FOLLOW_BYTES_PER_SEC) + 1;
+  }
+  if (state->arguments.max_rate > 0) {
+    long long rate_deadline = state->last_sent_at + 1000 / state->arguments.max_rate;
+    if (rate_deadline > deadline) deadline = rate_deadline;
+  }
+
+  return deadline;
+}
+
+// Returns what should be sent to the client and its length, which is needed
+// since binary output can contain zeros.
+static const char* get_state_output(client_state_t* state, size_t* len_out)
+{
+  if (is_table_request(state) || state->arguments.command == COMMAND_EVENTS) {
+    *len_out = state->stream_output.len;
+    return state->stream_output.data != NULL ? state->stream_output.data : "";
+  }
+  // Errors are still plain text with --json or --binary
+  if (state->arguments.encoding != ENCODING_TEXT && state->encoded_output.len > 0) {
+    *len_out = state->encoded_output.len;
+    return state->encoded_output.data;
+  }
+  *len_out = state->response.len;
+  return strbuf_str(&state->response);
+}
+
+// Renders a follower of a single player and marks it for sending if its
+// output changed. force re-renders even if the player wasn't updated.
+static void render_follower(client_state_t* state, player_snapshot_t* snapshot, bool force)
+{
+  const wnp_player_t* state_player = get_player_from_state(state, snapshot);
+  bool changed = force || state->player_last_id != state_player->id || state->player_last_updated_at != state_player->updated_at;
+  if (!force && state->arguments.on_fields != 0 && state->player_last_id == state_player->id) {
+    changed = watched_fields_changed(state, state_player);
+  }
+
+  if (changed && state->arguments.delta) {
+    // Fields of a throttled delta follower add up until they could be sent.
+    uint32_t fields = get_delta_fields(state, state_player, state->player_last_id == state_player->id);
+    state->render_fields = (state->send_pending ? state->render_fields : 0) | fields;
+    compute_state(state, snapshot);
+    state->send_pending = state->render_fields != 0;
+    state->player_last_id = state_player->id;
+    state->player_last_updated_at = state_player->updated_at;
+  } else if (changed && state->arguments.encoding != ENCODING_TEXT) {
+    // Render into the other buffer, so the previous output is still there to compare with.
+    strbuf_t previous = state->encoded_output;
+    state->encoded_output = state->encoded_previous;
+    state->encoded_previous = previous;
+    compute_state(state, snapshot);
+    size_t len;
+    const char* output = get_state_output(state, &len);
+    if (previous.data == NULL || previous.len != len || memcmp(previous.data, output, len) != 0) {
+      state->send_pending = true;
+    }
+    state->player_last_id = state_player->id;
+    state->player_last_updated_at = state_player->updated_at;
+  } else if (changed) {
+    // Renders are compared the same way for text, swapping keeps both buffers allocated.
+    strbuf_t previous = state->response;
+    state->response = state->response_previous;
+    state->response_previous = previous;
+    compute_state(state, snapshot);
+    if (previous.len != state->response.len || memcmp(strbuf_str(&previous), strbuf_str(&state->response), previous.len) != 0) {
+      state->send_pending = true;
+    }
+    state->player_last_id = state_player->id;
+    state->player_last_updated_at = state_player->updated_at;
+  }
+}
+
+static void render_table_follower(client_state_t* state, player_snapshot_t* snapshot)
+{
+  // Lines of a throttled table follower pile up until they could be sent.
+  if (!state->send_pending) {
+    strbuf_clear(&state->stream_output);
+  }
+  if (compute_player_table(state, snapshot)) {
+    state->send_pending = true;
+  }
+}
+
+// Returns when the output of the follower changes next without an update, or 0.
+// --on followers only asked for updates of their keys, so they don't get any
+// for extrapolated placeholders, but still scroll.
+static long long get_state_tick_at(client_state_t* state, player_snapshot_t* snapshot, long long now)
+{
+  if (!is_table_request(state)) {
+    const wnp_player_t* player = get_player_from_state(state, snapshot);
+    bool playing = player->id != -1 && player->state == WNP_STATE_PLAYING;
+    long long tick_at = state->scroll_length > 0 && playing ? state->scroll_next_at : 0;
+    long long position_tick_at = state->arguments.on_fields == 0 && state_extrapolates(state) ? get_position_tick_at(player, now) : 0;
+    if (position_tick_at != 0 && (tick_at == 0 || position_tick_at < tick_at)) tick_at = position_tick_at;
+    return tick_at;
+  }
+  if (state->arguments.on_fields != 0 || !state_extrapolates(state)) return 0;
+
+  long long tick_at = 0;
+  for (int i = 0; i < snapshot->count; i++) {
+    long long player_tick_at = get_position_tick_at(&snapshot->players[i], now);
+    if (player_tick_at != 0 && (tick_at == 0 || player_tick_at < tick_at)) tick_at = player_tick_at;
   }
+  return tick_at;
 }
 
-/**
- * On windows, taskkill and taskmgr don't fire
- * SIGTERM, so uh, cope? If you taskkill it then
- * you better know what you're doing anyway.
- *
- * It sends WM_CLOSE but we have no window so meh.
- **/
-void signal_handler(int signum)
+// Re-renders followers whose progress placeholders changed since their last
+// render, as the extrapolated position moved on, and moves --scroll output.
+// Returns the next time this has to happen, or -1.
+static long long tick_shard(follower_shard_t* shard)
 {
-  wnp_uninit();
-  exit(0);
+  long long now = get_wall_time_ms();
+  long long next_tick_at = -1;
+
+  for (int i = 0; i < MAX_STATES; i++) {
+    client_state_t* state = shard->states[i];
+    if (state == NULL || state->seen_snapshot == NULL || state->arguments.command == COMMAND_EVENTS) continue;
+
+    if (state->tick_at != 0 && state->tick_at <= now && is_table_request(state)) {
+      // Renders that didn't change are still skipped by their hash
+      for (int id = 0; id < WNP_MAX_PLAYERS; id++) {
+        state->table->seen_updated_at[id] = -1;
+      }
+      render_table_follower(state, state->seen_snapshot);
+    } else if (state->tick_at != 0 && state->tick_at <= now) {
+      render_follower(state, state->seen_snapshot, true);
+    }
+
+    state->tick_at = get_state_tick_at(state, state->seen_snapshot, now);
+    if (state->tick_at != 0 && (next_tick_at == -1 || state->tick_at < next_tick_at)) {
+      next_tick_at = state->tick_at;
+    }
+  }
+
+  return next_tick_at;
 }
 
-static void replace_placeholder(char* str, const char* placeholder, char* value)
+static void render_shard(follower_shard_t* shard, player_snapshot_t* snapshot, bool selected_only)
 {
-  char* found = strstr(str, placeholder);
-  if (found != NULL) {
-    memmove(found + strlen(value), found + strlen(placeholder), strlen(found + strlen(placeholder)) + 1);
-    memcpy(found, value, strlen(value));
+  for (int i = 0; i < MAX_STATES; i++) {
+    client_state_t* state = shard->states[i];
+    if (state != NULL && state->arguments.command == COMMAND_EVENTS) {
+      continue;
+    } else if (state != NULL && is_table_request(state)) {
+      if (!selected_only) {
+        render_table_follower(state, snapshot);
+      }
+    } else if (state != NULL && (!selected_only || state->arguments.player_id == PLAYER_ID_SELECTED)) {
+      render_follower(state, snapshot, false);
+    }
+    if (state != NULL) {
+      set_seen_snapshot(state, snapshot);
+    }
   }
 }
 
-static void assign_str(char dest[WNP_STR_LEN], const char* str)
+// Disconnects a follower that can't keep up instead of queueing for it
+// without end. Shutting the socket down wakes its handler, which removes it.
+static void drop_follower(client_state_t* state)
 {
-  if (str == NULL) return;
-  size_t len = strlen(str);
-  strncpy(dest, str, WNP_STR_LEN - 1);
-  dest[len < WNP_STR_LEN ? len : WNP_STR_LEN - 1] = '\0';
+  state->dropped = true;
+  state->send_pending = false;
+  strbuf_clear(&state->outbox);
+#ifdef _WIN32
+  shutdown(state->client_fd, SD_BOTH);
+#else
+  shutdown(state->client_fd, SHUT_RDWR);
+#endif
 }
 
-static void get_formatted_id(wnp_player_t* player, char id_out[WNP_STR_LEN])
+// Queues the latest render of every follower that is allowed to receive it.
+// Throttled followers keep their render and get it once their deadline has
+// passed, so the last state always goes out. Returns the earliest deadline
+// still pending, or -1 if there is none.
+static long long deliver_shard(follower_shard_t* shard)
 {
-  char name_lowercase[WNP_STR_LEN] = {0};
-  assign_str(name_lowercase, player->name);
-  for (char* p = id_out; *p; ++p) {
-    *p = tolower(*p);
+  long long now = get_time_ms();
+  long long next_deadline = -1;
+
+  for (int i = 0; i < MAX_STATES; i++) {
+    client_state_t* state = shard->states[i];
+    if (state == NULL || state->dropped || !state->send_pending) continue;
+
+    size_t len;
+    const char* output = get_state_output(state, &len);
+    long long deadline = get_follow_deadline(state, now);
+    if (deadline <= now) {
+      strbuf_append_len(&state->outbox, (const char*)&len, sizeof(len));
+      strbuf_append_len(&state->outbox, output, len);
+      state->send_pending = false;
+      state->last_sent_at = now;
+      state->tokens -= sizeof(len) + len;
+      if (state->outbox.len > FOLLOW_MAX_QUEUED) drop_follower(state);
+    } else if (state->outbox.len + len > FOLLOW_MAX_QUEUED) {
+      // Events and table lines pile up for as long as the bucket holds them back
+      drop_follower(state);
+    } else if (next_deadline == -1 || deadline < next_deadline) {
+      next_deadline = deadline;
+    }
   }
 
-  snprintf(id_out, WNP_STR_LEN, "%s%d", name_lowercase, player->id);
+  return next_deadline;
 }
 
-static void append_response(client_state_t* state, char* key, char* value)
+// Writes out what the sockets of the followers take without blocking.
+// Returns false if some outbox has to wait until its socket drained.
+static bool flush_followers(client_state_t* states[MAX_STATES])
 {
-  char formatted[MAX_RESPONSE_LEN];
-  snprintf(formatted, MAX_RESPONSE_LEN, "%-30s %s\n", key, value);
-  if (strlen(state->response) + strlen(formatted) < MAX_RESPONSE_LEN) {
-    strncat(state->response, formatted, MAX_RESPONSE_LEN - strlen(state->response) - 1);
+  bool flushed = true;
+  for (int i = 0; i < MAX_STATES; i++) {
+    client_state_t* state = states[i];
+    if (state == NULL || state->dropped || state->outbox.len == 0) continue;
+
+    size_t sent;
+    if (!send_available(state->client_fd, state->outbox.data, state->outbox.len, &sent)) {
+      drop_follower(state);
+      continue;
+    }
+    memmove(state->outbox.data, state->outbox.data + sent, state->outbox.len - sent);
+    state->outbox.len -= sent;
+    if (state->outbox.len > 0) flushed = false;
   }
+
+  return flushed;
 }
 
-static bool parse_format_str(const char* formatstr, char* formatout, char* defaultout)
+static int shard_thread(void* data)
 {
-  const char* default_start = strstr(formatstr, "{{default:");
-  if (default_start) {
-    size_t format_len = default_start - formatstr;
-    strncpy(formatout, formatstr, format_len);
+  follower_shard_t* shard = data;
+  long long next_deadline = -1;
+  long long next_tick_at = -1;
 
-    default_start += 10; // move past {{default:
-    const char* default_end = strstr(default_start, "}}");
-    if (default_end) {
-      size_t default_len = default_end - default_start;
-      strncpy(defaultout, default_start, default_len);
-      defaultout[default_len] = '\0';
+  while (1) {
+    // Deadlines are on the monotonic clock, ticks follow updated_at on the wall clock.
+    int timeout = THREAD_SIGNAL_WAIT_INFINITE;
+    if (next_deadline != -1) {
+      long long remaining = next_deadline - get_time_ms();
+      timeout = remaining > 0 ? (int)remaining : 0;
+    }
+    if (next_tick_at != -1) {
+      long long remaining = next_tick_at - get_wall_time_ms();
+      if (remaining < 0) remaining = 0;
+      if (timeout == THREAD_SIGNAL_WAIT_INFINITE || remaining < timeout) timeout = (int)remaining;
+    }
+    thread_signal_wait(&shard->wake, timeout);
 
-      default_end += 2; // move past }}
-      strcat(formatout, default_end);
+    // Only the latest snapshot matters, older ones were replaced in broadcast_snapshot.
+    // Events on the other hand are all kept and handed to every events follower.
+    thread_mutex_lock(&shard->lock);
+    if (shard->pending_events[ENCODING_TEXT].len > 0) {
+      for (int i = 0; i < MAX_STATES; i++) {
+        client_state_t* state = shard->states[i];
+        if (state == NULL || state->arguments.command != COMMAND_EVENTS) continue;
+        int encoding = state->arguments.encoding;
+        if (!state->send_pending) {
+          strbuf_clear(&state->stream_output);
+        } else if (encoding != ENCODING_BINARY) {
+          strbuf_append(&state->stream_output, "\n");
+        }
+        strbuf_append_len(&state->stream_output, shard->pending_events[encoding].data, shard->pending_events[encoding].len);
+        state->send_pending = true;
+      }
+      for (int i = 0; i < ENCODING_COUNT; i++) {
+        strbuf_clear(&shard->pending_events[i]);
+      }
+    }
+    player_snapshot_t* snapshot = shard->pending;
+    shard->pending = NULL;
+    if (snapshot != NULL) {
+      render_shard(shard, snapshot, shard->pending_selected_only);
+    }
+    next_tick_at = tick_shard(shard);
+    next_deadline = deliver_shard(shard);
+    // flush_lock is taken before the shard is unlocked, so remove_follower
+    // can wait for the flush to be done with the states copied here.
+    client_state_t* states[MAX_STATES];
+    memcpy(states, shard->states, sizeof(states));
+    thread_mutex_lock(&shard->flush_lock);
+    thread_mutex_unlock(&shard->lock);
 
-      return true;
+    if (!flush_followers(states)) {
+      long long retry_at = get_time_ms() + FOLLOW_RETRY_MS;
+      if (next_deadline == -1 || retry_at < next_deadline) next_deadline = retry_at;
     }
+    thread_mutex_unlock(&shard->flush_lock);
+
+    release_snapshot(snapshot);
   }
 
-  strcpy(formatout, formatstr);
-  defaultout[0] = '\0';
+  return 0;
+}
 
-  return false;
+// With selected_only, only followers of the selected player are re-rendered.
+// That's all a selection change needs, since no player changed.
+static void broadcast_snapshot(player_snapshot_t* snapshot, bool selected_only)
+{
+  for (int i = 0; i < g_shard_count; i++) {
+    follower_shard_t* shard = &g_shards[i];
+    thread_mutex_lock(&shard->lock);
+    // Snapshots are published and broadcast from several threads, so an older
+    // one can arrive after a newer one. Those are dropped, since every
+    // published snapshot gets broadcast to all followers by its publisher.
+    if (snapshot->version < shard->version || shard->state_count == 0) {
+      if (snapshot->version > shard->version) shard->version = snapshot->version;
+      thread_mutex_unlock(&shard->lock);
+      continue;
+    }
+    player_snapshot_t* previous = shard->pending;
+    thread_atomic_int_inc(&snapshot->refcount);
+    shard->pending = snapshot;
+    shard->version = snapshot->version;
+    shard->pending_selected_only = selected_only && (previous == NULL || shard->pending_selected_only);
+    thread_mutex_unlock(&shard->lock);
+
+    release_snapshot(previous);
+    thread_signal_raise(&shard->wake);
+  }
 }
 
-// Very naive implementation, but it works for now soooo.... can I be bothered?
-static void compute_metadata(client_state_t* state, wnp_player_t* player)
-{
-  char id_str[MAX_RESPONSE_LEN] = {0};
-  char name_str[MAX_RESPONSE_LEN] = {0};
-  char title_str[MAX_RESPONSE_LEN] = {0};
-  char artist_str[MAX_RESPONSE_LEN] = {0};
-  char album_str[MAX_RESPONSE_LEN] = {0};
-  char cover_str[MAX_RESPONSE_LEN] = {0};
-  char cover_src_str[MAX_RESPONSE_LEN] = {0};
-  char state_str[MAX_RESPONSE_LEN] = {0};
-  char position_str[MAX_RESPONSE_LEN] = {0};
-  char position_sec_str[MAX_RESPONSE_LEN] = {0};
-  char duration_str[MAX_RESPONSE_LEN] = {0};
-  char duration_sec_str[MAX_RESPONSE_LEN] = {0};
-  char volume_str[MAX_RESPONSE_LEN] = {0};
-  char rating_str[MAX_RESPONSE_LEN] = {0};
-  char repeat_str[MAX_RESPONSE_LEN] = {0};
-  char shuffle_str[MAX_RESPONSE_LEN] = {0};
-  char rating_system_str[MAX_RESPONSE_LEN] = {0};
-  char available_repeat_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_state_str[MAX_RESPONSE_LEN] = {0};
-  char can_skip_previous_str[MAX_RESPONSE_LEN] = {0};
-  char can_skip_next_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_position_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_volume_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_rating_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_repeat_str[MAX_RESPONSE_LEN] = {0};
-  char can_set_shuffle_str[MAX_RESPONSE_LEN] = {0};
-  char created_at_str[MAX_RESPONSE_LEN] = {0};
-  char updated_at_str[MAX_RESPONSE_LEN] = {0};
-  char active_at_str[MAX_RESPONSE_LEN] = {0};
-  char is_web_browser_str[MAX_RESPONSE_LEN] = {0};
-  char platform_str[MAX_RESPONSE_LEN] = {0};
+enum EVENT_TYPE {
+  EVENT_ADDED,
+  EVENT_UPDATED,
+  EVENT_REMOVED,
+  EVENT_ACTIVE_CHANGED,
+};
+
+static const char* g_event_names[] = {"added", "updated", "removed", "active-changed"};
+
+// Formats a libwnp callback as "<timestamp> <type> <id> <changed fields>", or
+// its JSON and binary equivalents, and queues it on every shard with an events
+// follower. The changed fields are found by comparing against the player in
+// the last published snapshot.
+static void broadcast_event(int type, const wnp_player_t* player)
+{
+  if (player == NULL || thread_atomic_int_load(&g_event_followers) == 0) {
+    return;
+  }
+
+  uint32_t changed = 0;
+  player_snapshot_t* previous = acquire_snapshot();
+  const wnp_player_t* before = snapshot_get_player(previous, player->id);
+  if (before == NULL) {
+    changed = type == EVENT_REMOVED ? 0 : ALL_FIELDS;
+  } else {
+    changed = diff_players(before, player);
+  }
+  release_snapshot(previous);
 
+  long long timestamp = get_wall_time_ms();
   char formatted_id[WNP_STR_LEN] = {0};
   get_formatted_id(player, formatted_id);
-  snprintf(id_str, MAX_RESPONSE_LEN, "%s", formatted_id);
-  snprintf(name_str, MAX_RESPONSE_LEN, "%s", player->name);
-  snprintf(title_str, MAX_RESPONSE_LEN, "%s", player->title);
-  snprintf(artist_str, MAX_RESPONSE_LEN, "%s", player->artist);
-  snprintf(album_str, MAX_RESPONSE_LEN, "%s", player->album);
-  snprintf(cover_str, MAX_RESPONSE_LEN, "%s", player->cover);
-  snprintf(cover_src_str, MAX_RESPONSE_LEN, "%s", player->cover_src);
-  char* state_values[] = {"playing", "paused", "stopped"};
-  snprintf(state_str, MAX_RESPONSE_LEN, "%s", state_values[player->state]);
-  wnp_format_seconds(player->position, false, position_str);
-  snprintf(position_sec_str, MAX_RESPONSE_LEN, "%d", player->position);
-  wnp_format_seconds(player->duration, false, duration_str);
-  snprintf(duration_sec_str, MAX_RESPONSE_LEN, "%d", player->duration);
-  snprintf(volume_str, MAX_RESPONSE_LEN, "%d", player->volume);
-  snprintf(rating_str, MAX_RESPONSE_LEN, "%d", player->rating);
-  char* repeat_str_values[] = {"", "none", "all", "", "one"};
-  snprintf(repeat_str, MAX_RESPONSE_LEN, "%s", repeat_str_values[player->repeat]);
-  snprintf(shuffle_str, MAX_RESPONSE_LEN, "%s", player->shuffle ? "true" : "false");
-  char* rating_systems_values[] = {"none", "like", "like-dislike", "scale"};
-  snprintf(rating_system_str, MAX_RESPONSE_LEN, "%s", rating_systems_values[player->rating_system]);
-  snprintf(available_repeat_str, MAX_RESPONSE_LEN, "%d", player->available_repeat);
-  snprintf(can_set_state_str, MAX_RESPONSE_LEN, "%s", player->can_set_state ? "true" : "false");
-  snprintf(can_skip_previous_str, MAX_RESPONSE_LEN, "%s", player->can_skip_previous ? "true" : "false");
-  snprintf(can_skip_next_str, MAX_RESPONSE_LEN, "%s", player->can_skip_next ? "true" : "false");
-  snprintf(can_set_position_str, MAX_RESPONSE_LEN, "%s", player->can_set_position ? "true" : "false");
-  snprintf(can_set_volume_str, MAX_RESPONSE_LEN, "%s", player->can_set_volume ? "true" : "false");
-  snprintf(can_set_rating_str, MAX_RESPONSE_LEN, "%s", player->can_set_rating ? "true" : "false");
-  snprintf(can_set_repeat_str, MAX_RESPONSE_LEN, "%s", player->can_set_repeat ? "true" : "false");
-  snprintf(can_set_shuffle_str, MAX_RESPONSE_LEN, "%s", player->can_set_shuffle ? "true" : "false");
-  snprintf(created_at_str, MAX_RESPONSE_LEN, "%ld", player->created_at);
-  snprintf(updated_at_str, MAX_RESPONSE_LEN, "%ld", player->updated_at);
-  snprintf(active_at_str, MAX_RESPONSE_LEN, "%ld", player->active_at);
-  snprintf(is_web_browser_str, MAX_RESPONSE_LEN, "%s", player->is_web_browser ? "true" : "false");
-  char* platforms[] = {"none", "web", "linux", "darwin", "windows"};
-  snprintf(platform_str, MAX_RESPONSE_LEN, "%s", platforms[player->platform]);
 
-  if (strlen(state->arguments.format) > 0) {
-    char format_str[MAX_RESPONSE_LEN] = {0};
-    char default_str[MAX_RESPONSE_LEN] = {0};
-    if (parse_format_str(state->arguments.format, format_str, default_str) && player->id == -1) {
-      strncpy(state->response, default_str, MAX_RESPONSE_LEN);
-      return;
+  thread_mutex_lock(&g_event_lock);
+  strbuf_t* encoded = g_event_encoded;
+  for (int e = 0; e < ENCODING_COUNT; e++) {
+    strbuf_clear(&encoded[e]);
+  }
+  strbuf_t* text = &encoded[ENCODING_TEXT];
+  strbuf_printf(text, "%lld %s %s ", timestamp, g_event_names[type], formatted_id);
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    if (changed & g_fields[i].dirty_bit) {
+      if (text->data[text->len - 1] != ' ') strbuf_append(text, ",");
+      strbuf_append(text, g_fields[i].name);
     }
+  }
+  if (changed == 0) strbuf_append(text, "-");
 
-    strncpy(state->response, format_str, MAX_RESPONSE_LEN);
-    replace_placeholder(state->response, "{{id}}", id_str);
-    replace_placeholder(state->response, "{{name}}", name_str);
-    replace_placeholder(state->response, "{{title}}", title_str);
-    replace_placeholder(state->response, "{{artist}}", artist_str);
-    replace_placeholder(state->response, "{{album}}", album_str);
-    replace_placeholder(state->response, "{{cover}}", cover_str);
-    replace_placeholder(state->response, "{{cover-src}}", cover_src_str);
-    replace_placeholder(state->response, "{{state}}", state_str);
-    replace_placeholder(state->response, "{{position}}", position_str);
-    replace_placeholder(state->response, "{{position-sec}}", position_sec_str);
-    replace_placeholder(state->response, "{{duration}}", duration_str);
-    replace_placeholder(state->response, "{{duration-sec}}", duration_sec_str);
-    replace_placeholder(state->response, "{{volume}}", volume_str);
-    replace_placeholder(state->response, "{{rating}}", rating_str);
-    replace_placeholder(state->response, "{{repeat}}", repeat_str);
-    replace_placeholder(state->response, "{{shuffle}}", shuffle_str);
-    replace_placeholder(state->response, "{{rating-system}}", rating_system_str);
-    replace_placeholder(state->response, "{{available-repeat}}", available_repeat_str);
-    replace_placeholder(state->response, "{{can-set-state}}", can_set_state_str);
-    replace_placeholder(state->response, "{{can-skip-previous}}", can_skip_previous_str);
-    replace_placeholder(state->response, "{{can-skip-next}}", can_skip_next_str);
-    replace_placeholder(state->response, "{{can-set-position}}", can_set_position_str);
-    replace_placeholder(state->response, "{{can-set-volume}}", can_set_volume_str);
-    replace_placeholder(state->response, "{{can-set-rating}}", can_set_rating_str);
-    replace_placeholder(state->response, "{{can-set-repeat}}", can_set_repeat_str);
-    replace_placeholder(state->response, "{{can-set-shuffle}}", can_set_shuffle_str);
-    replace_placeholder(state->response, "{{created-at}}", created_at_str);
-    replace_placeholder(state->response, "{{updated-at}}", updated_at_str);
-    replace_placeholder(state->response, "{{active-at}}", active_at_str);
-    replace_placeholder(state->response, "{{is-web-browser}}", is_web_browser_str);
-    replace_placeholder(state->response, "{{platform}}", platform_str);
-    return;
+  json_writer_t writer, fields_writer;
+  json_begin(&writer, &encoded[ENCODING_JSON], "{");
+  json_add_int(&writer, "timestamp", timestamp);
+  json_add_string(&writer, "type", g_event_names[type]);
+  json_add_string(&writer, "id", formatted_id);
+  json_key(&writer, "fields");
+  json_begin(&fields_writer, &encoded[ENCODING_JSON], "[");
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    if (changed & g_fields[i].dirty_bit) json_add_string(&fields_writer, NULL, g_fields[i].name);
   }
+  json_end(&fields_writer, "]");
+  json_end(&writer, "}");
 
-  switch (state->arguments.command_arg) {
-    case METADATA_ALL:
-      append_response(state, "id", id_str);
-      append_response(state, "name", name_str);
-      append_response(state, "title", title_str);
-      append_response(state, "artist", artist_str);
-      append_response(state, "album", album_str);
-      append_response(state, "cover", cover_str);
-      append_response(state, "cover-src", cover_src_str);
-      append_response(state, "state", state_str);
-      append_response(state, "position", position_str);
-      append_response(state, "position-sec", position_sec_str);
-      append_response(state, "duration", duration_str);
-      append_response(state, "duration-sec", duration_sec_str);
-      append_response(state, "volume", volume_str);
-      append_response(state, "rating", rating_str);
-      append_response(state, "repeat", repeat_str);
-      append_response(state, "shuffle", shuffle_str);
-      append_response(state, "rating-system", rating_system_str);
-      append_response(state, "available-repeat", available_repeat_str);
-      append_response(state, "can-set-state", can_set_state_str);
-      append_response(state, "can-skip-previous", can_skip_previous_str);
-      append_response(state, "can-skip-next", can_skip_next_str);
-      append_response(state, "can-set-position", can_set_position_str);
-      append_response(state, "can-set-volume", can_set_volume_str);
-      append_response(state, "can-set-rating", can_set_rating_str);
-      append_response(state, "can-set-repeat", can_set_repeat_str);
-      append_response(state, "can-set-shuffle", can_set_shuffle_str);
-      append_response(state, "created-at", created_at_str);
-      append_response(state, "updated-at", updated_at_str);
-      append_response(state, "active-at", active_at_str);
-      append_response(state, "is-web-browser", is_web_browser_str);
-      append_response(state, "platform", platform_str);
-      break;
-    case METADATA_ID:
-      strncpy(state->response, id_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_NAME:
-      strncpy(state->response, name_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_TITLE:
-      strncpy(state->response, title_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_ARTIST:
-      strncpy(state->response, artist_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_ALBUM:
-      strncpy(state->response, album_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_COVER:
-      strncpy(state->response, cover_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_COVER_SRC:
-      strncpy(state->response, cover_src_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_STATE:
-      strncpy(state->response, state_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_POSITION:
-      strncpy(state->response, position_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_POSITION_SEC:
-      strncpy(state->response, position_sec_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_DURATION:
-      strncpy(state->response, duration_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_DURATION_SEC:
-      strncpy(state->response, duration_sec_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_VOLUME:
-      strncpy(state->response, volume_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_RATING:
-      strncpy(state->response, rating_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_REPEAT:
-      strncpy(state->response, repeat_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_SHUFFLE:
-      strncpy(state->response, shuffle_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_RATING_SYSTEM:
-      strncpy(state->response, rating_system_str, MAX_RESPONSE_LEN);
-    case METADATA_AVAILABLE_REPEAT:
-      strncpy(state->response, available_repeat_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_STATE:
-      strncpy(state->response, can_set_state_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SKIP_PREVIOUS:
-      strncpy(state->response, can_skip_previous_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SKIP_NEXT:
-      strncpy(state->response, can_skip_next_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_POSITION:
-      strncpy(state->response, can_set_position_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_VOLUME:
-      strncpy(state->response, can_set_volume_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_RATING:
-      strncpy(state->response, can_set_rating_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_REPEAT:
-      strncpy(state->response, can_set_repeat_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CAN_SET_SHUFFLE:
-      strncpy(state->response, can_set_shuffle_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_CREATED_AT:
-      strncpy(state->response, created_at_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_UPDATED_AT:
-      strncpy(state->response, updated_at_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_ACTIVE_AT:
-      strncpy(state->response, active_at_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_IS_WEB_BROWSER:
-      strncpy(state->response, is_web_browser_str, MAX_RESPONSE_LEN);
-      break;
-    case METADATA_PLATFORM:
-      strncpy(state->response, platform_str, MAX_RESPONSE_LEN);
-      break;
+  strbuf_t* binary = &encoded[ENCODING_BINARY];
+  binary_append_varint(binary, BINARY_EVENT);
+  binary_append_varint(binary, timestamp);
+  binary_append_varint(binary, type);
+  binary_append_string(binary, formatted_id);
+  binary_append_varint(binary, changed);
+
+  for (int i = 0; i < g_shard_count; i++) {
+    follower_shard_t* shard = &g_shards[i];
+    thread_mutex_lock(&shard->lock);
+    if (shard->event_state_count == 0) {
+      thread_mutex_unlock(&shard->lock);
+      continue;
+    }
+    for (int e = 0; e < ENCODING_COUNT; e++) {
+      if (e != ENCODING_BINARY && shard->pending_events[e].len > 0) strbuf_append(&shard->pending_events[e], "\n");
+      strbuf_append_len(&shard->pending_events[e], encoded[e].data, encoded[e].len);
+    }
+    thread_mutex_unlock(&shard->lock);
+    thread_signal_raise(&shard->wake);
   }
+
+  thread_mutex_unlock(&g_event_lock);
 }
 
-static void compute_state(client_state_t* state)
+// Assigns the follower to the least loaded shard. Returns NULL if all shards are full.
+static follower_shard_t* add_follower(client_state_t* state)
 {
-  if (state->arguments.list_all) {
-    wnp_player_t players[WNP_MAX_PLAYERS];
-    int count = wnp_get_all_players(players);
-    char player_info[MAX_RESPONSE_LEN];
-    memset(player_info, 0, sizeof(player_info));
-
-    for (int i = 0; i < count; i++) {
-      char info[MAX_RESPONSE_LEN];
-      char formatted_id[WNP_STR_LEN] = {0};
-      get_formatted_id(&players[i], formatted_id);
-      snprintf(info, MAX_RESPONSE_LEN, "%s %s\n", formatted_id, players[i].name);
-      strncat(player_info, info, MAX_RESPONSE_LEN - strlen(player_info) - 1);
+  follower_shard_t* best = NULL;
+  for (int i = 0; i < g_shard_count; i++) {
+    if (best == NULL || g_shards[i].state_count < best->state_count) {
+      best = &g_shards[i];
     }
-
-    strncpy(state->response, player_info, MAX_RESPONSE_LEN);
-    state->should_close = true;
-    return;
   }
 
-  wnp_player_t player = WNP_DEFAULT_PLAYER;
-  get_player_from_state(state, &player);
-  int event_id = -1;
-
-  switch (state->arguments.command) {
-    case COMMAND_STOP_DAEMON:
-      // Need to send the messages in here instead of after compute_state
-      // since we stop the daemon here.
-      printf("Received stop-daemon. Stopping...\n");
-      send_message(state->client_fd, "Daemon stopped.");
-      signal_handler(SIGTERM);
-      break;
-    case COMMAND_METADATA:
-      compute_metadata(state, &player);
-      state->should_close = !state->arguments.follow;
-      break;
-    case COMMAND_SET_STATE:
-      event_id = wnp_try_set_state(&player, state->arguments.command);
-      break;
-    case COMMAND_SKIP_PREVIOUS:
-      event_id = wnp_try_skip_previous(&player);
-      break;
-    case COMMAND_SKIP_NEXT:
-      event_id = wnp_try_skip_next(&player);
-      break;
-    case COMMAND_SET_POSITION:
-      if (state->arguments.flags & RELATIVE_POSITION_PLUS) {
-        event_id = wnp_try_forward(&player, state->arguments.command_arg);
-      } else if (state->arguments.flags & RELATIVE_POSITION_MINUS) {
-        event_id = wnp_try_revert(&player, state->arguments.command_arg);
-      } else {
-        event_id = wnp_try_set_position(&player, state->arguments.command_arg);
-      }
-      break;
-    case COMMAND_SET_VOLUME:
-      if (state->arguments.flags & RELATIVE_POSITION_PLUS) {
-        event_id = wnp_try_set_volume(&player, state->arguments.command_arg + player.volume);
-      } else if (state->arguments.flags & RELATIVE_POSITION_MINUS) {
-        event_id = wnp_try_set_volume(&player, state->arguments.command_arg - player.volume);
-      } else {
-        event_id = wnp_try_set_volume(&player, state->arguments.command_arg);
-      }
-      break;
-    case COMMAND_SET_RATING:
-      event_id = wnp_try_set_rating(&player, state->arguments.command_arg);
-      break;
-    case COMMAND_SET_REPEAT:
-      event_id = wnp_try_set_repeat(&player, state->arguments.command_arg);
-      break;
-    case COMMAND_SET_SHUFFLE:
-      event_id = wnp_try_set_shuffle(&player, state->arguments.command_arg);
-      break;
-    case COMMAND_PLAY_PAUSE:
-      event_id = wnp_try_play_pause(&player);
-      break;
-    case COMMAND_TOGGLE_REPEAT:
-      event_id = wnp_try_toggle_repeat(&player);
-      break;
-    case COMMAND_SELECT_ACTIVE:
-      g_selected_player_id = PLAYER_ID_ACTIVE;
-      break;
-    case COMMAND_SELECT_PREVIOUS: {
-      bool found = false;
-
-      // Search between <current> and 0
-      for (int i = player.id - 1; i >= 0; i--) {
-        wnp_player_t new_player = WNP_DEFAULT_PLAYER;
-        if (wnp_get_player(i, &new_player)) {
-          g_selected_player_id = new_player.id;
-          found = true;
-          break;
-        }
-      }
+  if (best == NULL) return NULL;
 
-      if (!found) {
-        // Search between <max> and <current>
-        for (int i = WNP_MAX_PLAYERS; i > player.id; i--) {
-          wnp_player_t new_player = WNP_DEFAULT_PLAYER;
-          if (wnp_get_player(i, &player)) {
-            g_selected_player_id = player.id;
-            found = true;
-            break;
-          }
-        }
+  thread_mutex_lock(&best->lock);
+  for (int i = 0; i < MAX_STATES; i++) {
+    if (best->states[i] == NULL) {
+      best->states[i] = state;
+      best->state_count++;
+      if (state->arguments.command == COMMAND_EVENTS) {
+        best->event_state_count++;
+        thread_atomic_int_inc(&g_event_followers);
       }
-
-      state->should_close = true;
-      if (!found) {
-        snprintf(state->response, MAX_RESPONSE_LEN, "No player to select was found");
-      } else {
-        char formatted_id[MAX_RESPONSE_LEN] = {0};
-        get_formatted_id(&player, formatted_id);
-        snprintf(state->response, MAX_RESPONSE_LEN, "Selected player %s", formatted_id);
+      thread_mutex_unlock(&best->lock);
+      // Let the shard schedule the first tick of progress placeholders or --scroll
+      if (state->arguments.scroll_width > 0 || state_extrapolates(state)) {
+        thread_signal_raise(&best->wake);
       }
-      break;
+      return best;
     }
-    case COMMAND_SELECT_NEXT: {
-      bool found = false;
-
-      // Search between <current> and <max>
-      for (int i = player.id + 1; i < WNP_MAX_PLAYERS; i++) {
-        wnp_player_t new_player = WNP_DEFAULT_PLAYER;
-        if (wnp_get_player(i, &player)) {
-          g_selected_player_id = new_player.id;
-          found = true;
-          break;
-        }
-      }
+  }
+  thread_mutex_unlock(&best->lock);
 
-      if (!found) {
-        // Search between 0 and <current>
-        for (int i = 0; i < player.id; i++) {
-          wnp_player_t new_player = WNP_DEFAULT_PLAYER;
-          if (wnp_get_player(i, &player)) {
-            g_selected_player_id = new_player.id;
-            found = true;
-            break;
-          }
-        }
-      }
+  return NULL;
+}
 
-      state->should_close = true;
-      if (!found) {
-        snprintf(state->response, MAX_RESPONSE_LEN, "No player to select was found");
-      } else {
-        char formatted_id[MAX_RESPONSE_LEN] = {0};
-        get_formatted_id(&player, formatted_id);
-        snprintf(state->response, MAX_RESPONSE_LEN, "Selected player %s", formatted_id);
+static void remove_follower(follower_shard_t* shard, client_state_t* state)
+{
+  thread_mutex_lock(&shard->lock);
+  for (int i = 0; i < MAX_STATES; i++) {
+    if (shard->states[i] == state) {
+      shard->states[i] = NULL;
+      shard->state_count--;
+      if (state->arguments.command == COMMAND_EVENTS) {
+        shard->event_state_count--;
+        thread_atomic_int_dec(&g_event_followers);
       }
       break;
     }
   }
+  thread_mutex_unlock(&shard->lock);
 
-  if (event_id != -1) {
-    if (state->arguments.wait) {
-      wnp_event_result_t result = wnp_wait_for_event_result(event_id);
-      char* responses[] = {"PENDING", "SUCCEEDED", "FAILED"};
-      snprintf(state->response, MAX_RESPONSE_LEN, "%s", responses[result]);
-      state->should_close = true;
-      return;
-    } else {
-      snprintf(state->response, MAX_RESPONSE_LEN, "%d", event_id);
-      state->should_close = true;
-      return;
-    }
+  // The shard may still be flushing to the follower
+  thread_mutex_lock(&shard->flush_lock);
+  thread_mutex_unlock(&shard->flush_lock);
+}
+
+static void start_shards()
+{
+  g_shard_count = get_core_count();
+  for (int i = 0; i < g_shard_count; i++) {
+    follower_shard_t* shard = &g_shards[i];
+    memset(shard->states, 0, sizeof(shard->states));
+    shard->state_count = 0;
+    shard->event_state_count = 0;
+    shard->pending = NULL;
+    memset(shard->pending_events, 0, sizeof(shard->pending_events));
+    shard->pending_selected_only = false;
+    shard->version = 0;
+    thread_signal_init(&shard->wake);
+    thread_mutex_init(&shard->lock);
+    thread_mutex_init(&shard->flush_lock);
+    shard->thread = thread_create(shard_thread, shard, THREAD_STACK_SIZE_DEFAULT);
+    thread_detach(shard->thread);
   }
 }
 
 static void on_any_wnp_update(wnp_player_t* player, void* data)
 {
-  for (int i = 0; i < MAX_STATES; i++) {
-    client_state_t* state = g_states[i];
-    if (state != NULL) {
-      wnp_player_t player = WNP_DEFAULT_PLAYER;
-      get_player_from_state(state, &player);
-      if (state->player_last_updated_at != player.updated_at) {
-        char* last_response = strdup(state->response);
-        compute_state(state);
-        if (strcmp(last_response, state->response) != 0) {
-          send_message(state->client_fd, state->response);
-        }
-        state->player_last_updated_at = player.updated_at;
-        free(last_response);
-      }
+  player_snapshot_t* snapshot = publish_snapshot();
+  if (snapshot == NULL) {
+    return;
+  }
+
+  broadcast_snapshot(snapshot, false);
+  release_snapshot(snapshot);
+}
+
+static void on_player_added(wnp_player_t* player, void* data)
+{
+  broadcast_event(EVENT_ADDED, player);
+  player_index_add(player);
+  on_any_wnp_update(player, data);
+}
+
+static void on_player_updated(wnp_player_t* player, void* data)
+{
+  broadcast_event(EVENT_UPDATED, player);
+  player_index_update(player);
+  on_any_wnp_update(player, data);
+}
+
+static void on_player_removed(wnp_player_t* player, void* data)
+{
+  broadcast_event(EVENT_REMOVED, player);
+  player_index_remove(player);
+  on_any_wnp_update(player, data);
+}
+
+static void on_active_player_changed(wnp_player_t* player, void* data)
+{
+  broadcast_event(EVENT_ACTIVE_CHANGED, player);
+  if (player != NULL) {
+    player_index_update(player);
+  }
+
+  if (g_active_debounce_ms <= 0) {
+    on_any_wnp_update(player, data);
+    return;
+  }
+
+  // Flips are only recorded here, active_debounce_thread publishes them once they settle.
+  thread_mutex_lock(&g_active_lock);
+  note_active_candidate(player != NULL ? player->id : -1);
+  thread_mutex_unlock(&g_active_lock);
+}
+
+static int active_debounce_thread(void* data)
+{
+  while (1) {
+    thread_mutex_lock(&g_active_lock);
+    int timeout = THREAD_SIGNAL_WAIT_INFINITE;
+    if (g_active_candidate_id != g_active_player_id) {
+      long long remaining = g_active_candidate_since + g_active_debounce_ms - get_time_ms();
+      timeout = remaining > 0 ? (int)remaining : 0;
+    }
+    thread_mutex_unlock(&g_active_lock);
+
+    // Timing out means the candidate stayed put for the whole debounce window.
+    if (!thread_signal_wait(&g_active_wake, timeout)) {
+      on_any_wnp_update(NULL, NULL);
     }
   }
+
+  return 0;
+}
+
+// Everything of a connection lives in its arena, except for the snapshot and view it holds.
+static void release_follower_state(client_state_t* state)
+{
+  if (state->seen_snapshot != NULL) {
+    release_snapshot(state->seen_snapshot);
+  }
+  release_view(state->view);
+  arena_release(state->arena);
 }
 
 static int handle_client(void* data)
 {
-  int client_fd = *((int*)data);
-  client_state_t state = {{false, -1, "", false, false, false, -1, -1}, "", false, client_fd, 0};
+  int client_fd = (int)(intptr_t)data;
+  thread_atomic_int_inc(&g_connection_count);
 
-  if (recv(client_fd, &state.arguments, sizeof(arguments_t), 0) <= 0) {
-    return 0;
-  } else {
-    compute_state(&state);
-    send_message(client_fd, state.response);
+  // The state and its buffers are allocated in the arena, which is released on disconnect
+  arena_t arena = {0};
+  client_state_t* state = arena_alloc(&arena, sizeof(client_state_t));
+  state->arena = &arena;
+  state->client_fd = client_fd;
+  state->bound_id = -1;
+  state->player_last_id = -1;
+  state->render_fields = ALL_FIELDS;
+  strbuf_t* buffers[] = {&state->response,     &state->response_previous, &state->stream_output,     &state->encoded_output,
+                         &state->encoded_previous, &state->format_output,    &state->filter_scratch[0], &state->filter_scratch[1],
+                         &state->scroll_text, &state->outbox};
+  for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+    buffers[i]->arena = &arena;
+  }
 
-    if (state.should_close) {
-      close_fd(client_fd);
-      return 0;
-    }
+  player_snapshot_t* snapshot = NULL;
+  if (!recv_all(client_fd, &state->arguments, sizeof(arguments_t)) || (snapshot = acquire_snapshot()) == NULL) {
+    release_follower_state(state);
+    close_fd(client_fd);
+    thread_atomic_int_dec(&g_connection_count);
+    return 0;
+  }
 
-    int index = -1;
-    for (int i = 0; i < MAX_STATES; i++) {
-      if (g_states[i] == NULL) {
-        index = i;
-        g_states[i] = &state;
-        break;
-      }
+  int selected_player_id = g_selected_player_id;
+  if (state->arguments.command == COMMAND_VIEW && !attach_view(state)) {
+    strbuf_printf(&state->response, "No view named %s", state->arguments.view);
+    state->should_close = true;
+  } else {
+    compute_state(state, snapshot);
+  }
+  if (g_selected_player_id != selected_player_id) {
+    // The request's snapshot may be older than what the shards have by now
+    player_snapshot_t* latest = acquire_snapshot();
+    if (latest != NULL) {
+      broadcast_snapshot(latest, true);
+      release_snapshot(latest);
     }
+  }
+  if ((state->arguments.on_fields != 0 || state->arguments.delta) && !is_table_request(state)) {
+    state->player_last_id = get_player_from_state(state, snapshot)->id;
+  }
+  set_seen_snapshot(state, snapshot);
+  release_snapshot(snapshot);
+  size_t sent = 0;
+  if (state->arguments.command != COMMAND_EVENTS) {
+    size_t len;
+    const char* output = get_state_output(state, &len);
+    send_message_len(client_fd, output, len);
+    sent = sizeof(len) + len;
+  }
 
-    if (index == -1) {
+  follower_shard_t* shard = NULL;
+  if (!state->should_close) {
+    reset_follow_limits(state, get_time_ms(), sent);
+    set_nonblocking(client_fd, true);
+    shard = add_follower(state);
+    if (shard == NULL) {
+      set_nonblocking(client_fd, false);
       send_message(client_fd, "Too many clients connected");
-      close_fd(client_fd);
-      return 0;
     }
-
-    recv(client_fd, NULL, 0, 0);
-    g_states[index] = NULL;
   }
 
+  if (shard != NULL) {
+    wait_for_disconnect(client_fd);
+    remove_follower(shard, state);
+  }
+  release_follower_state(state);
+  close_fd(client_fd);
+  thread_atomic_int_dec(&g_connection_count);
   return 0;
 }
 
-int start_daemon()
+// Handlers mostly wait for their client to disconnect, all rendering happens
+// on the shards. They get a small stack, thread.h doesn't pass a stack size
+// on to pthreads so they are created directly there.
+#define HANDLER_STACK_SIZE (256 * 1024)
+
+#ifndef _WIN32
+static void* handler_thread(void* data)
+{
+  handle_client(data);
+  return NULL;
+}
+#endif
+
+static bool start_handler(int client_fd)
+{
+  void* data = (void*)(intptr_t)client_fd;
+#ifdef _WIN32
+  thread_ptr_t thread = thread_create(handle_client, data, HANDLER_STACK_SIZE);
+  if (thread == NULL) return false;
+  thread_detach(thread);
+  return true;
+#else
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HANDLER_STACK_SIZE);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  bool started = pthread_create(&thread, &attr, handler_thread, data) == 0;
+  pthread_attr_destroy(&attr);
+  return started;
+#endif
+}
+
+int start_daemon(const arguments_t* arguments)
 {
 #ifdef _WIN32
   WSADATA wsaData;
@@ -606,8 +3041,21 @@ int start_daemon()
   }
 #endif
 
-  for (int i = 0; i < MAX_STATES; i++) {
-    g_states[i] = NULL;
+  thread_mutex_init(&g_snapshot_lock);
+  thread_mutex_init(&g_snapshot_pool_lock);
+  thread_mutex_init(&g_event_lock);
+  thread_mutex_init(&g_view_lock);
+  // Views are compiled up front, so mistakes in them show up on start
+  reload_views_if_changed();
+  thread_atomic_int_store(&g_event_followers, 0);
+  player_index_init();
+  start_shards();
+
+  g_active_debounce_ms = arguments->active_debounce;
+  if (g_active_debounce_ms > 0) {
+    thread_mutex_init(&g_active_lock);
+    thread_signal_init(&g_active_wake);
+    thread_detach(thread_create(active_debounce_thread, NULL, THREAD_STACK_SIZE_DEFAULT));
   }
 
   signal(SIGINT, signal_handler);
@@ -616,10 +3064,10 @@ int start_daemon()
   wnp_args_t args = {
       .web_port = CLI_PORT,
       .adapter_version = WNPCLI_VERSION,
-      .on_player_added = &on_any_wnp_update,
-      .on_player_updated = &on_any_wnp_update,
-      .on_player_removed = &on_any_wnp_update,
-      .on_active_player_changed = &on_any_wnp_update,
+      .on_player_added = &on_player_added,
+      .on_player_updated = &on_player_updated,
+      .on_player_removed = &on_player_removed,
+      .on_active_player_changed = &on_active_player_changed,
       .callback_data = NULL,
   };
 
@@ -631,7 +3079,6 @@ int start_daemon()
 
   int server_fd, client_fd;
   struct sockaddr_un server_addr, client_addr;
-  thread_ptr_t thread;
 
   server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
   if (server_fd == -1) {
@@ -658,8 +3105,9 @@ int start_daemon()
       return -1;
     }
 
-    thread = thread_create(handle_client, &client_fd, THREAD_STACK_SIZE_DEFAULT);
-    thread_detach(thread);
+    if (!start_handler(client_fd)) {
+      close_fd(client_fd);
+    }
   }
 
   close_fd(server_fd);
@@ -0,0 +1,197 @@
+#include "fields.h"
+
+static const char* g_state_names[] = {"playing", "paused", "stopped"};
+static const char* g_platform_names[] = {"none", "web", "linux", "darwin", "windows"};
+static const char* g_repeat_names[] = {"", "none", "all", "", "one"};
+static const char* g_rating_system_names[] = {"none", "like", "like-dislike", "scale"};
+
+void get_formatted_id(const wnp_player_t* player, char id_out[WNP_STR_LEN])
+{
+  char name_lowercase[WNP_STR_LEN] = {0};
+  snprintf(name_lowercase, WNP_STR_LEN, "%s", player->name);
+  for (char* p = name_lowercase; *p; ++p) {
+    *p = tolower(*p);
+  }
+
+  snprintf(id_out, WNP_STR_LEN, "%s%d", name_lowercase, player->id);
+}
+
+static field_value_t get_id(const wnp_player_t* player, char scratch[WNP_STR_LEN])
+{
+  get_formatted_id(player, scratch);
+  return (field_value_t){FIELD_STRING, player->id, scratch};
+}
+
+#define STRING_GETTER(member)                                                                                                                        \
+  static field_value_t get_##member(const wnp_player_t* player, char scratch[WNP_STR_LEN])                                                         \
+  {                                                                                                                                                  \
+    return (field_value_t){FIELD_STRING, 0, player->member};                                                                                         \
+  }
+#define NUMBER_GETTER(member, type)                                                                                                                  \
+  static field_value_t get_##member(const wnp_player_t* player, char scratch[WNP_STR_LEN])                                                         \
+  {                                                                                                                                                  \
+    return (field_value_t){type, player->member, NULL};                                                                                              \
+  }
+#define ENUM_GETTER(member, names)                                                                                                                   \
+  static field_value_t get_##member(const wnp_player_t* player, char scratch[WNP_STR_LEN])                                                         \
+  {                                                                                                                                                  \
+    return (field_value_t){FIELD_ENUM, player->member, names[player->member]};                                                                       \
+  }
+
+STRING_GETTER(name)
+STRING_GETTER(title)
+STRING_GETTER(artist)
+STRING_GETTER(album)
+STRING_GETTER(cover)
+STRING_GETTER(cover_src)
+ENUM_GETTER(state, g_state_names)
+NUMBER_GETTER(position, FIELD_TIME)
+NUMBER_GETTER(duration, FIELD_TIME)
+NUMBER_GETTER(volume, FIELD_INT)
+NUMBER_GETTER(rating, FIELD_INT)
+ENUM_GETTER(repeat, g_repeat_names)
+NUMBER_GETTER(shuffle, FIELD_BOOL)
+ENUM_GETTER(rating_system, g_rating_system_names)
+NUMBER_GETTER(available_repeat, FIELD_INT)
+NUMBER_GETTER(can_set_state, FIELD_BOOL)
+NUMBER_GETTER(can_skip_previous, FIELD_BOOL)
+NUMBER_GETTER(can_skip_next, FIELD_BOOL)
+NUMBER_GETTER(can_set_position, FIELD_BOOL)
+NUMBER_GETTER(can_set_volume, FIELD_BOOL)
+NUMBER_GETTER(can_set_rating, FIELD_BOOL)
+NUMBER_GETTER(can_set_repeat, FIELD_BOOL)
+NUMBER_GETTER(can_set_shuffle, FIELD_BOOL)
+NUMBER_GETTER(created_at, FIELD_INT)
+NUMBER_GETTER(updated_at, FIELD_INT)
+NUMBER_GETTER(active_at, FIELD_INT)
+NUMBER_GETTER(is_web_browser, FIELD_BOOL)
+ENUM_GETTER(platform, g_platform_names)
+
+// The -sec keys share the value of position and duration, but print it as plain seconds.
+static field_value_t get_position_sec(const wnp_player_t* player, char scratch[WNP_STR_LEN])
+{
+  return (field_value_t){FIELD_INT, player->position, NULL};
+}
+
+static field_value_t get_duration_sec(const wnp_player_t* player, char scratch[WNP_STR_LEN])
+{
+  return (field_value_t){FIELD_INT, player->duration, NULL};
+}
+
+static void format_string(field_value_t value, char out[FIELD_VALUE_LEN])
+{
+  snprintf(out, FIELD_VALUE_LEN, "%s", value.string);
+}
+
+static void format_int(field_value_t value, char out[FIELD_VALUE_LEN])
+{
+  snprintf(out, FIELD_VALUE_LEN, "%lld", value.number);
+}
+
+static void format_time(field_value_t value, char out[FIELD_VALUE_LEN])
+{
+  wnp_format_seconds((int)value.number, false, out);
+}
+
+static void format_bool(field_value_t value, char out[FIELD_VALUE_LEN])
+{
+  snprintf(out, FIELD_VALUE_LEN, "%s", value.number ? "true" : "false");
+}
+
+#define FIELD(key, metadata, type, member, format) {key, metadata, type, 1u << metadata, get_##member, format}
+
+const field_t g_fields[METADATA_COUNT] = {
+    FIELD("id", METADATA_ID, FIELD_STRING, id, format_string),
+    FIELD("name", METADATA_NAME, FIELD_STRING, name, format_string),
+    FIELD("title", METADATA_TITLE, FIELD_STRING, title, format_string),
+    FIELD("artist", METADATA_ARTIST, FIELD_STRING, artist, format_string),
+    FIELD("album", METADATA_ALBUM, FIELD_STRING, album, format_string),
+    FIELD("cover", METADATA_COVER, FIELD_STRING, cover, format_string),
+    FIELD("cover-src", METADATA_COVER_SRC, FIELD_STRING, cover_src, format_string),
+    FIELD("state", METADATA_STATE, FIELD_ENUM, state, format_string),
+    FIELD("position", METADATA_POSITION, FIELD_TIME, position, format_time),
+    FIELD("position-sec", METADATA_POSITION_SEC, FIELD_INT, position_sec, format_int),
+    FIELD("duration", METADATA_DURATION, FIELD_TIME, duration, format_time),
+    FIELD("duration-sec", METADATA_DURATION_SEC, FIELD_INT, duration_sec, format_int),
+    FIELD("volume", METADATA_VOLUME, FIELD_INT, volume, format_int),
+    FIELD("rating", METADATA_RATING, FIELD_INT, rating, format_int),
+    FIELD("repeat", METADATA_REPEAT, FIELD_ENUM, repeat, format_string),
+    FIELD("shuffle", METADATA_SHUFFLE, FIELD_BOOL, shuffle, format_bool),
+    FIELD("rating-system", METADATA_RATING_SYSTEM, FIELD_ENUM, rating_system, format_string),
+    FIELD("available-repeat", METADATA_AVAILABLE_REPEAT, FIELD_INT, available_repeat, format_int),
+    FIELD("can-set-state", METADATA_CAN_SET_STATE, FIELD_BOOL, can_set_state, format_bool),
+    FIELD("can-skip-previous", METADATA_CAN_SKIP_PREVIOUS, FIELD_BOOL, can_skip_previous, format_bool),
+    FIELD("can-skip-next", METADATA_CAN_SKIP_NEXT, FIELD_BOOL, can_skip_next, format_bool),
+    FIELD("can-set-position", METADATA_CAN_SET_POSITION, FIELD_BOOL, can_set_position, format_bool),
+    FIELD("can-set-volume", METADATA_CAN_SET_VOLUME, FIELD_BOOL, can_set_volume, format_bool),
+    FIELD("can-set-rating", METADATA_CAN_SET_RATING, FIELD_BOOL, can_set_rating, format_bool),
+    FIELD("can-set-repeat", METADATA_CAN_SET_REPEAT, FIELD_BOOL, can_set_repeat, format_bool),
+    FIELD("can-set-shuffle", METADATA_CAN_SET_SHUFFLE, FIELD_BOOL, can_set_shuffle, format_bool),
+    FIELD("created-at", METADATA_CREATED_AT, FIELD_INT, created_at, format_int),
+    FIELD("updated-at", METADATA_UPDATED_AT, FIELD_INT, updated_at, format_int),
+    FIELD("active-at", METADATA_ACTIVE_AT, FIELD_INT, active_at, format_int),
+    FIELD("is-web-browser", METADATA_IS_WEB_BROWSER, FIELD_BOOL, is_web_browser, format_bool),
+    FIELD("platform", METADATA_PLATFORM, FIELD_ENUM, platform, format_string),
+};
+
+// Names are looked up through a perfect hash: FNV-1a, multiplied by
+// FIELD_HASH_SEED and reduced to the top bits. The seed was picked so no
+// two names share a slot, fields_init complains if a new name breaks that.
+#define FIELD_SLOT_BITS 6
+#define FIELD_HASH_SEED 32753u
+static signed char g_field_slots[1 << FIELD_SLOT_BITS];
+
+static unsigned int get_field_slot(const char* name, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return (uint32_t)(hash * FIELD_HASH_SEED) >> (32 - FIELD_SLOT_BITS);
+}
+
+void fields_init()
+{
+  memset(g_field_slots, -1, sizeof(g_field_slots));
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    unsigned int slot = get_field_slot(g_fields[i].name, strlen(g_fields[i].name));
+    if (g_field_slots[slot] != -1) {
+      fprintf(stderr, "Metadata keys %s and %s share a slot, FIELD_HASH_SEED needs to be changed\n", g_fields[i].name,
+              g_fields[(int)g_field_slots[slot]].name);
+      abort();
+    }
+    g_field_slots[slot] = i;
+  }
+}
+
+const field_t* find_field(const char* name, size_t len)
+{
+  int index = g_field_slots[get_field_slot(name, len)];
+  if (index == -1) return NULL;
+
+  const field_t* field = &g_fields[index];
+  if (strlen(field->name) != len || strncmp(field->name, name, len) != 0) return NULL;
+  return field;
+}
+
+void format_field(const wnp_player_t* player, int field, char out[FIELD_VALUE_LEN])
+{
+  char scratch[WNP_STR_LEN] = {0};
+  g_fields[field].format(g_fields[field].get(player, scratch), out);
+}
+
+// Returns the dirty bit of every field that differs between a and b.
+uint32_t diff_players(const wnp_player_t* a, const wnp_player_t* b)
+{
+  uint32_t changed = 0;
+  for (int i = 0; i < METADATA_COUNT; i++) {
+    char scratch_a[WNP_STR_LEN], scratch_b[WNP_STR_LEN];
+    field_value_t value_a = g_fields[i].get(a, scratch_a);
+    field_value_t value_b = g_fields[i].get(b, scratch_b);
+    if (value_a.number != value_b.number || (value_a.type == FIELD_STRING && strcmp(value_a.string, value_b.string) != 0)) {
+      changed |= g_fields[i].dirty_bit;
+    }
+  }
+  return changed;
+}
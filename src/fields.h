@@ -0,0 +1,46 @@
+#ifndef WNPCLI_FIELDS_H
+#define WNPCLI_FIELDS_H
+
+#include "wnpcli.h"
+
+#define ALL_FIELDS ((1u << METADATA_COUNT) - 1)
+// Values are at most a libwnp string, or a number
+#define FIELD_VALUE_LEN (WNP_STR_LEN + 32)
+
+enum FIELD_TYPE {
+  FIELD_STRING,
+  FIELD_INT,
+  FIELD_TIME,
+  FIELD_BOOL,
+  FIELD_ENUM,
+};
+
+// A metadata field in its native type. Enums have both their number and name.
+typedef struct {
+  int type;
+  long long number;
+  const char* string;
+} field_value_t;
+
+// Describes one metadata key. Everything that parses, renders or diffs
+// metadata goes through g_fields, indexed by METADATA_*.
+typedef struct {
+  const char* name;
+  int id;
+  int type;
+  uint32_t dirty_bit;
+  // scratch is used by fields that have to build their value, like id
+  field_value_t (*get)(const wnp_player_t* player, char scratch[WNP_STR_LEN]);
+  void (*format)(field_value_t value, char out[FIELD_VALUE_LEN]);
+} field_t;
+
+extern const field_t g_fields[METADATA_COUNT];
+
+// Builds the name lookup, has to be called before find_field
+extern void fields_init();
+extern const field_t* find_field(const char* name, size_t len);
+extern void format_field(const wnp_player_t* player, int field, char out[FIELD_VALUE_LEN]);
+extern uint32_t diff_players(const wnp_player_t* a, const wnp_player_t* b);
+extern void get_formatted_id(const wnp_player_t* player, char id_out[WNP_STR_LEN]);
+
+#endif /* WNPCLI_FIELDS_H */
@@ -1,3 +1,4 @@
+#include "fields.h"
 #include "wnpcli.h"
 
 static struct cag_option options[] = {
@@ -7,12 +8,19 @@ static struct cag_option options[] = {
         .access_name = "no-detach",
         .description = "Do not detach the daemon",
     },
+    {
+        .identifier = 'd',
+        .access_letters = "d",
+        .access_name = "active-debounce",
+        .value_name = "MS",
+        .description = "Only let the daemon switch the active player once it stayed active for MS milliseconds",
+    },
     {
         .identifier = 'p',
         .access_letters = "p",
         .access_name = "player",
         .value_name = "ID",
-        .description = "The player to target. Can be active, selected, or a players ID (default: active)",
+        .description = "The player to target. Can be active, selected, a players ID, a player name or a query (default: active)",
     },
     {
         .identifier = 'f',
@@ -21,17 +29,70 @@ static struct cag_option options[] = {
         .value_name = "FORMAT",
         .description = "A format string for printing properties and metadata",
     },
+    {
+        .identifier = 'N',
+        .access_letters = "N",
+        .access_name = "named-format",
+        .value_name = "NAME=FORMAT",
+        .description = "Add a named format string, can be repeated. Prints NAME=OUTPUT for each of them",
+    },
+    {
+        .identifier = 'j',
+        .access_letters = "j",
+        .access_name = "json",
+        .description = "Print metadata, player lists and events as JSON, one object per line",
+    },
+    {
+        .identifier = 'b',
+        .access_letters = "b",
+        .access_name = "binary",
+        .description = "Print metadata, player lists and events in the compact binary encoding",
+    },
+    {
+        .identifier = 'D',
+        .access_letters = "D",
+        .access_name = "delta",
+        .description = "When following all metadata, only send the fields that changed after the first update",
+    },
     {
         .identifier = 'F',
         .access_letters = "F",
         .access_name = "follow",
         .description = "Block and append the query to output when it changes",
     },
+    {
+        .identifier = 'r',
+        .access_letters = "r",
+        .access_name = "max-rate",
+        .value_name = "HZ",
+        .description = "Send at most HZ updates per second when following, always ending on the latest state",
+    },
+    {
+        .identifier = 's',
+        .access_letters = "s",
+        .access_name = "scroll",
+        .value_name = "WIDTH",
+        .description = "Scroll the output through WIDTH characters when it is longer than that, while the player is playing",
+    },
+    {
+        .identifier = 'S',
+        .access_letters = "S",
+        .access_name = "scroll-rate",
+        .value_name = "HZ",
+        .description = "Move --scroll output by HZ characters per second (default: 4)",
+    },
+    {
+        .identifier = 'o',
+        .access_letters = "o",
+        .access_name = "on",
+        .value_name = "FIELDS",
+        .description = "Only send updates when following if one of the comma separated metadata keys changed",
+    },
     {
         .identifier = 'l',
         .access_letters = "l",
         .access_name = "list-all",
-        .description = "List the ids of all players",
+        .description = "List the ids of all players, with their name or the format string",
     },
     {
         .identifier = 'w',
@@ -57,22 +118,25 @@ static void print_help()
 {
   printf("Usage: wnpcli [OPTION...] COMMAND [ARG]\n\n");
   printf("Available Commands:\n");
-  printf("  start-daemon            Starts the daemon\n");
-  printf("  stop-daemon             Stops the daemon\n");
-  printf("  metadata [key]          Prints metadata information\n");
-  printf("  set-state [state]       Can be PLAYING, PAUSED or STOPPED\n");
-  printf("  skip-previous           Skip to the previous track\n");
-  printf("  skip-next               Skip to the next track\n");
-  printf("  set-position [x][+/-]   Set the position or seek forward/backward x in seconds\n");
-  printf("  set-volume [x][+/-]     Set the volume from 0 to 100\n");
-  printf("  set-rating [x]          Set the rating from 0 to 5\n");
-  printf("  set-repeat [repeat]     Set the repeat mode. Can be NONE, ALL or ONE\n");
-  printf("  set-shuffle [shuffle]   Set the shuffle. Can be 0 or 1\n");
-  printf("  play-pause              Toggle between playing/paused\n");
-  printf("  toggle-repeat           Toggle between repeat modes\n");
-  printf("  select-active           Set the selection to the active player\n");
-  printf("  select-previous         Set the selection to the previous player\n");
-  printf("  select-next             Set the selection to the next player\n");
+  printf("  start-daemon              Starts the daemon\n");
+  printf("  stop-daemon               Stops the daemon\n");
+  printf("  metadata [key]            Prints metadata information\n");
+  printf("  set-state [state]         Can be PLAYING, PAUSED or STOPPED\n");
+  printf("  skip-previous             Skip to the previous track\n");
+  printf("  skip-next                 Skip to the next track\n");
+  printf("  set-position [x][+/-]     Set the position or seek forward/backward x in seconds\n");
+  printf("  set-volume [x][+/-]       Set the volume from 0 to 100\n");
+  printf("  set-rating [x]            Set the rating from 0 to 5\n");
+  printf("  set-repeat [repeat]       Set the repeat mode. Can be NONE, ALL or ONE\n");
+  printf("  set-shuffle [shuffle]     Set the shuffle. Can be 0 or 1\n");
+  printf("  play-pause                Toggle between playing/paused\n");
+  printf("  toggle-repeat             Toggle between repeat modes\n");
+  printf("  select-active             Set the selection to the active player\n");
+  printf("  select-previous [order]   Set the selection to the previous player. Order can be id or recent\n");
+  printf("  select-next [order]       Set the selection to the next player. Order can be id or recent\n");
+  printf("  events                    Stream player events as they happen\n");
+  printf("  stats                     Print how much memory the daemon and its connections use\n");
+  printf("  view [name]               Print a view from the daemon's views.conf\n");
   printf("\n");
   printf("Available Options:\n");
   cag_option_print(options, CAG_ARRAY_SIZE(options), stdout);
@@ -80,58 +144,110 @@ static void print_help()
 
 static int parse_player_id(const char* str)
 {
-  int start = -1;
-  int i = 0;
+  if (str[0] == '\0') {
+    return -1;
+  }
 
-  while (str[i] != '\0') {
-    if (str[i] >= 48 && str[i] <= 57) {
-      start = i;
-      break;
+  for (int i = 0; str[i] != '\0'; i++) {
+    if (!isdigit((unsigned char)str[i])) {
+      return -1;
     }
-    i++;
   }
 
-  if (start == -1) {
-    return -1;
+  return atoi(str);
+}
+
+// Turns a comma separated list of metadata keys into a mask of (1 << METADATA_*).
+// Returns 0 if one of them is invalid.
+static uint32_t parse_field_mask(const char* str)
+{
+  uint32_t mask = 0;
+  const char* key = str;
+  while (*key != '\0') {
+    const char* end = strchr(key, ',');
+    if (end == NULL) end = key + strlen(key);
+
+    const field_t* field = find_field(key, end - key);
+    if (field == NULL) {
+      printf("Invalid metadata key: %.*s\nSee 'wnpcli metadata' for all valid keys\n", (int)(end - key), key);
+      return 0;
+    }
+    mask |= field->dirty_bit;
+
+    key = *end == ',' ? end + 1 : end;
   }
 
-  const char* numstr = str + i;
-  return atoi(numstr);
+  return mask;
 }
 
-static arguments_t parse_args(int argc, char** argv)
+bool parse_arguments(int argc, char** argv, bool view, arguments_t* out)
 {
   char identifier;
   cag_option_context context;
-  arguments_t arguments = {false, PLAYER_ID_ACTIVE, "", false, false, false, -1, -1, 0};
+  // Everything not listed starts out zeroed, which is off or empty
+  arguments_t arguments = {
+      .player_id = PLAYER_ID_ACTIVE,
+      .command = -1,
+      .command_arg = -1,
+      .encoding = ENCODING_TEXT,
+      .scroll_rate = DEFAULT_SCROLL_RATE,
+  };
   int param_index;
   int command_index = -1;
+  bool output_options = false;
 
   cag_option_prepare(&context, options, CAG_ARRAY_SIZE(options), argc, argv);
   while (cag_option_fetch(&context)) {
     identifier = cag_option_get(&context);
+    // How the output is sent and received stays up to the client
+    if (view && strchr("ndFrwbhv", identifier) != NULL) {
+      printf("-%c can't be used in a view\n", identifier);
+      return false;
+    }
+    if (strchr("Fr", identifier) == NULL) {
+      output_options = true;
+    }
     switch (identifier) {
       case 'n':
         arguments.no_detach = true;
         break;
+      case 'd': {
+        const char* debounce_str = cag_option_get_value(&context);
+        if (debounce_str == NULL || atoi(debounce_str) < 0) {
+          printf("Invalid debounce: %s\n", debounce_str == NULL ? "" : debounce_str);
+          return false;
+        }
+        arguments.active_debounce = atoi(debounce_str);
+        break;
+      }
       case 'p': {
         const char* player_str = cag_option_get_value(&context);
         if (player_str == NULL) {
           printf("No player is was provided\n");
-          exit(EXIT_FAILURE);
+          return false;
         }
 
         if (strcmp(player_str, "active") == 0) {
           arguments.player_id = PLAYER_ID_ACTIVE;
         } else if (strcmp(player_str, "selected") == 0) {
           arguments.player_id = PLAYER_ID_SELECTED;
+        } else if (strcmp(player_str, "all") == 0 || strncmp(player_str, "all:", 4) == 0) {
+          arguments.player_id = PLAYER_ID_ALL;
+          if (player_str[3] == ':') {
+            strncpy(arguments.player_query, player_str + 4, sizeof(arguments.player_query) - 1);
+            for (char* p = arguments.player_query; *p; ++p) {
+              *p = tolower(*p);
+            }
+          }
+        } else if (parse_player_id(player_str) != -1) {
+          arguments.player_id = parse_player_id(player_str);
         } else {
-          int player_id = parse_player_id(player_str);
-          if (player_id == -1) {
-            printf("Invalid player id: %s\n", player_str);
-            exit(EXIT_FAILURE);
+          // Formatted ids and names are resolved by the daemon
+          arguments.player_id = PLAYER_ID_QUERY;
+          strncpy(arguments.player_query, player_str, sizeof(arguments.player_query) - 1);
+          for (char* p = arguments.player_query; *p; ++p) {
+            *p = tolower(*p);
           }
-          arguments.player_id = player_id;
         }
 
         break;
@@ -140,14 +256,74 @@ static arguments_t parse_args(int argc, char** argv)
         const char* format_str = cag_option_get_value(&context);
         if (format_str == NULL) {
           printf("No format string was provided\n");
-          exit(EXIT_FAILURE);
+          return false;
         }
         strncpy(arguments.format, format_str, sizeof(arguments.format) - 1);
         break;
       }
+      case 'N': {
+        const char* named_str = cag_option_get_value(&context);
+        const char* separator = named_str == NULL ? NULL : strchr(named_str, '=');
+        if (separator == NULL || separator == named_str) {
+          printf("Invalid named format: %s\nHas to be NAME=FORMAT\n", named_str == NULL ? "" : named_str);
+          return false;
+        }
+        if (arguments.named_format_count == MAX_NAMED_FORMATS) {
+          printf("Too many named formats, at most %d can be used\n", MAX_NAMED_FORMATS);
+          return false;
+        }
+        strncpy(arguments.named_formats[arguments.named_format_count++], named_str, sizeof(arguments.named_formats[0]) - 1);
+        break;
+      }
+      case 'j':
+        arguments.encoding = ENCODING_JSON;
+        break;
+      case 'b':
+        arguments.encoding = ENCODING_BINARY;
+        break;
+      case 'D':
+        arguments.delta = true;
+        break;
       case 'F':
         arguments.follow = true;
         break;
+      case 'r': {
+        const char* rate_str = cag_option_get_value(&context);
+        if (rate_str == NULL || atoi(rate_str) <= 0) {
+          printf("Invalid max rate: %s\n", rate_str == NULL ? "" : rate_str);
+          return false;
+        }
+        arguments.max_rate = atoi(rate_str);
+        break;
+      }
+      case 's': {
+        const char* width_str = cag_option_get_value(&context);
+        if (width_str == NULL || atoi(width_str) <= 0) {
+          printf("Invalid scroll width: %s\n", width_str == NULL ? "" : width_str);
+          return false;
+        }
+        arguments.scroll_width = atoi(width_str);
+        break;
+      }
+      case 'S': {
+        const char* rate_str = cag_option_get_value(&context);
+        if (rate_str == NULL || atoi(rate_str) <= 0 || atoi(rate_str) > MAX_SCROLL_RATE) {
+          printf("Invalid scroll rate: %s\nHas to be between 1 and %d\n", rate_str == NULL ? "" : rate_str, MAX_SCROLL_RATE);
+          return false;
+        }
+        arguments.scroll_rate = atoi(rate_str);
+        break;
+      }
+      case 'o': {
+        const char* fields_str = cag_option_get_value(&context);
+        if (fields_str == NULL || fields_str[0] == '\0') {
+          printf("No metadata keys were provided\n");
+          return false;
+        }
+        arguments.on_fields = parse_field_mask(fields_str);
+        if (arguments.on_fields == 0) return false;
+        break;
+      }
       case 'l':
         arguments.list_all = true;
         break;
@@ -200,80 +376,28 @@ static arguments_t parse_args(int argc, char** argv)
         arguments.command = COMMAND_SELECT_PREVIOUS;
       } else if (strcmp(command, "select-next") == 0) {
         arguments.command = COMMAND_SELECT_NEXT;
+      } else if (strcmp(command, "events") == 0) {
+        arguments.command = COMMAND_EVENTS;
+      } else if (strcmp(command, "stats") == 0) {
+        arguments.command = COMMAND_STATS;
+      } else if (strcmp(command, "view") == 0) {
+        arguments.command = COMMAND_VIEW;
       }
     } else if (arguments.command_arg == -1) {
       char* command_arg = argv[param_index];
       switch (arguments.command) {
-        case COMMAND_METADATA:
+        case COMMAND_METADATA: {
+          const field_t* field = find_field(command_arg, strlen(command_arg));
           if (strcmp(command_arg, "all") == 0) {
             arguments.command_arg = METADATA_ALL;
-          } else if (strcmp(command_arg, "id") == 0) {
-            arguments.command_arg = METADATA_ID;
-          } else if (strcmp(command_arg, "name") == 0) {
-            arguments.command_arg = METADATA_NAME;
-          } else if (strcmp(command_arg, "title") == 0) {
-            arguments.command_arg = METADATA_TITLE;
-          } else if (strcmp(command_arg, "artist") == 0) {
-            arguments.command_arg = METADATA_ARTIST;
-          } else if (strcmp(command_arg, "album") == 0) {
-            arguments.command_arg = METADATA_ALBUM;
-          } else if (strcmp(command_arg, "cover") == 0) {
-            arguments.command_arg = METADATA_COVER;
-          } else if (strcmp(command_arg, "cover-src") == 0) {
-            arguments.command_arg = METADATA_COVER_SRC;
-          } else if (strcmp(command_arg, "state") == 0) {
-            arguments.command_arg = METADATA_STATE;
-          } else if (strcmp(command_arg, "position") == 0) {
-            arguments.command_arg = METADATA_POSITION;
-          } else if (strcmp(command_arg, "position-sec") == 0) {
-            arguments.command_arg = METADATA_POSITION_SEC;
-          } else if (strcmp(command_arg, "duration") == 0) {
-            arguments.command_arg = METADATA_DURATION;
-          } else if (strcmp(command_arg, "duration-sec") == 0) {
-            arguments.command_arg = METADATA_DURATION_SEC;
-          } else if (strcmp(command_arg, "volume") == 0) {
-            arguments.command_arg = METADATA_VOLUME;
-          } else if (strcmp(command_arg, "rating") == 0) {
-            arguments.command_arg = METADATA_RATING;
-          } else if (strcmp(command_arg, "repeat") == 0) {
-            arguments.command_arg = METADATA_REPEAT;
-          } else if (strcmp(command_arg, "shuffle") == 0) {
-            arguments.command_arg = METADATA_SHUFFLE;
-          } else if (strcmp(command_arg, "rating-system") == 0) {
-            arguments.command_arg = METADATA_RATING_SYSTEM;
-          } else if (strcmp(command_arg, "available-repeat") == 0) {
-            arguments.command_arg = METADATA_AVAILABLE_REPEAT;
-          } else if (strcmp(command_arg, "can-set-state") == 0) {
-            arguments.command_arg = METADATA_CAN_SET_STATE;
-          } else if (strcmp(command_arg, "can-skip-previous") == 0) {
-            arguments.command_arg = METADATA_CAN_SKIP_PREVIOUS;
-          } else if (strcmp(command_arg, "can-skip-next") == 0) {
-            arguments.command_arg = METADATA_CAN_SKIP_NEXT;
-          } else if (strcmp(command_arg, "can-set-position") == 0) {
-            arguments.command_arg = METADATA_POSITION;
-          } else if (strcmp(command_arg, "can-set-volume") == 0) {
-            arguments.command_arg = METADATA_CAN_SET_VOLUME;
-          } else if (strcmp(command_arg, "can-set-rating") == 0) {
-            arguments.command_arg = METADATA_CAN_SET_RATING;
-          } else if (strcmp(command_arg, "can-set-repeat") == 0) {
-            arguments.command_arg = METADATA_CAN_SET_REPEAT;
-          } else if (strcmp(command_arg, "can-set-shuffle") == 0) {
-            arguments.command_arg = METADATA_CAN_SET_SHUFFLE;
-          } else if (strcmp(command_arg, "created-at") == 0) {
-            arguments.command_arg = METADATA_CREATED_AT;
-          } else if (strcmp(command_arg, "updated-at") == 0) {
-            arguments.command_arg = METADATA_UPDATED_AT;
-          } else if (strcmp(command_arg, "active-at") == 0) {
-            arguments.command_arg = METADATA_ACTIVE_AT;
-          } else if (strcmp(command_arg, "is-web-browser") == 0) {
-            arguments.command_arg = METADATA_IS_WEB_BROWSER;
-          } else if (strcmp(command_arg, "platform") == 0) {
-            arguments.command_arg = METADATA_PLATFORM;
+          } else if (field != NULL) {
+            arguments.command_arg = field->id;
           } else {
             printf("Invalid metadata argument: %s\nSee 'wnpcli metadata' for all valid arguments\n", command_arg);
-            exit(EXIT_FAILURE);
+            return false;
           }
           break;
+        }
         case COMMAND_SET_STATE:
           if (strcmp(command_arg, "PLAYING") == 0) {
             arguments.command_arg = WNP_STATE_PLAYING;
@@ -283,7 +407,7 @@ static arguments_t parse_args(int argc, char** argv)
             arguments.command_arg = WNP_STATE_STOPPED;
           } else {
             printf("Invalid state. Has to be PLAYING, PAUSED or STOPPED.\n");
-            exit(EXIT_FAILURE);
+            return false;
           }
           break;
         case COMMAND_SET_POSITION: {
@@ -300,7 +424,7 @@ static arguments_t parse_args(int argc, char** argv)
           arguments.command_arg = atoi(command_arg);
           if (arguments.command_arg > 100 || arguments.command_arg < 0) {
             printf("Invalid volume: %d\n", arguments.command_arg);
-            exit(EXIT_FAILURE);
+            return false;
           }
           char last_char = command_arg[strlen(command_arg) - 1];
           if (last_char == '+') {
@@ -313,7 +437,7 @@ static arguments_t parse_args(int argc, char** argv)
           arguments.command_arg = atoi(command_arg);
           if (arguments.command_arg > 5 || arguments.command_arg < 0) {
             printf("Invalid rating: %d\n", arguments.command_arg);
-            exit(EXIT_FAILURE);
+            return false;
           }
           break;
         case COMMAND_SET_REPEAT:
@@ -325,23 +449,88 @@ static arguments_t parse_args(int argc, char** argv)
             arguments.command_arg = WNP_REPEAT_ONE;
           } else {
             printf("Invalid repeat mode. Has to be NONE, ALL or ONE.\n");
-            exit(EXIT_FAILURE);
+            return false;
           }
           break;
         case COMMAND_SET_SHUFFLE:
           arguments.command_arg = atoi(command_arg);
           if (arguments.command_arg != 0 && arguments.command_arg != 1) {
             printf("Invalid shuffle state: %d\n", arguments.command_arg);
-            exit(EXIT_FAILURE);
+            return false;
+          }
+          break;
+        case COMMAND_VIEW:
+          if (strlen(command_arg) >= sizeof(arguments.view)) {
+            printf("View names can be at most %d characters long\n", VIEW_NAME_LEN - 1);
+            return false;
+          }
+          strcpy(arguments.view, command_arg);
+          break;
+        case COMMAND_SELECT_PREVIOUS:
+        case COMMAND_SELECT_NEXT:
+          if (strcmp(command_arg, "id") == 0) {
+            arguments.command_arg = SELECT_ORDER_ID;
+          } else if (strcmp(command_arg, "recent") == 0) {
+            arguments.command_arg = SELECT_ORDER_RECENT;
+          } else {
+            printf("Invalid selection order. Has to be id or recent.\n");
+            return false;
           }
           break;
       }
     }
   }
 
+  // A view prints metadata, unless it has --list-all
+  if (view && arguments.command == -1) {
+    arguments.command = COMMAND_METADATA;
+  } else if (view && arguments.command != COMMAND_METADATA) {
+    printf("Views can only print metadata\n");
+    return false;
+  }
+
   if (!arguments.list_all && arguments.command == -1) {
     printf("No command was provided.\nSee 'wnpcli --help' for more.\n");
-    exit(EXIT_FAILURE);
+    return false;
+  }
+
+  if (arguments.delta && (arguments.format[0] != '\0' || arguments.named_format_count > 0 || arguments.command_arg != METADATA_ALL)) {
+    printf("--delta only works with all metadata and without a format\n");
+    return false;
+  }
+
+  // Table lines are keyed by player, all metadata as text would span several lines per player
+  if (arguments.player_id == PLAYER_ID_ALL && arguments.command == COMMAND_METADATA && !arguments.list_all &&
+      arguments.encoding == ENCODING_TEXT && arguments.format[0] == '\0' && arguments.command_arg == METADATA_ALL) {
+    printf("metadata with -p all needs a format or a single key, or --json or --binary\n");
+    return false;
+  }
+
+  if (arguments.encoding == ENCODING_BINARY && (arguments.format[0] != '\0' || arguments.named_format_count > 0)) {
+    printf("Format strings can't be used with --binary\n");
+    return false;
+  }
+
+  if (arguments.scroll_width > 0 && (arguments.command != COMMAND_METADATA || arguments.list_all || arguments.player_id == PLAYER_ID_ALL ||
+                                     arguments.named_format_count > 0 || arguments.encoding != ENCODING_TEXT ||
+                                     (arguments.format[0] == '\0' && arguments.command_arg == METADATA_ALL))) {
+    printf("--scroll only works with metadata of one player, with a format or a single key\n");
+    return false;
+  }
+
+  if (arguments.named_format_count > 0 && (arguments.list_all || arguments.player_id == PLAYER_ID_ALL)) {
+    printf("Named formats can't be used with --list-all or -p all\n");
+    return false;
+  }
+
+  if (arguments.command == COMMAND_VIEW && arguments.view[0] == '\0') {
+    printf("No view name was provided\n");
+    return false;
+  }
+
+  if (arguments.command == COMMAND_VIEW && output_options) {
+    printf("Only --follow and --max-rate can be used with a view, everything else is part of it\n");
+    return false;
   }
 
   if (command_index != -1) {
@@ -355,13 +544,14 @@ static arguments_t parse_args(int argc, char** argv)
       case COMMAND_SET_SHUFFLE:
         if (arguments.command_arg == -1) {
           printf("No argument provided for command %s\n", argv[command_index]);
-          exit(EXIT_FAILURE);
+          return false;
         }
         break;
     }
   }
 
-  return arguments;
+  *out = arguments;
+  return true;
 }
 
 static void no_daemon()
@@ -408,7 +598,7 @@ static int connect_sock(arguments_t arguments)
     printf("WSAStartup failed\n");
     return EXIT_FAILURE;
   }
-  _setmode(_fileno(stdout), 0x00020000); // _O_U16TEXT
+  _setmode(_fileno(stdout), arguments.encoding == ENCODING_BINARY ? 0x8000 : 0x00020000); // _O_BINARY or _O_U16TEXT
 #endif
 
   int client_fd;
@@ -428,39 +618,58 @@ static int connect_sock(arguments_t arguments)
     return EXIT_FAILURE;
   }
 
-  if (send(client_fd, &arguments, sizeof(arguments_t), 0) == -1) {
+  if (!send_all(client_fd, &arguments, sizeof(arguments_t))) {
     no_daemon();
     return EXIT_FAILURE;
   }
 
+  // Messages can be of any size. The buffers only grow, so following doesn't allocate for every message.
   size_t message_len;
+  size_t message_cap = 0;
   char* message_buffer = NULL;
+#ifdef _WIN64
+  uint16_t* utf16_buffer = NULL;
+#endif
   while (true) {
-    if (recv(client_fd, &message_len, sizeof(message_len), 0) <= 0) {
+    if (!recv_all(client_fd, &message_len, sizeof(message_len))) {
       break;
     }
 
-    message_buffer = calloc(1, message_len + 1);
-    if (recv(client_fd, message_buffer, message_len, 0) <= 0) {
+    if (message_len + 1 > message_cap) {
+      message_cap = message_len + 1;
+      free(message_buffer);
+      message_buffer = malloc(message_cap);
+#ifdef _WIN64
+      // UTF-16 never needs more code units than UTF-8 needs bytes
+      free(utf16_buffer);
+      utf16_buffer = malloc(message_cap * sizeof(uint16_t));
+      if (utf16_buffer == NULL) break;
+#endif
+      if (message_buffer == NULL) break;
+    }
+    if (!recv_all(client_fd, message_buffer, message_len)) {
       break;
     }
 
     message_buffer[message_len] = '\0';
+    if (arguments.encoding == ENCODING_BINARY) {
+      fwrite(message_buffer, 1, message_len, stdout);
+    } else {
 #ifdef _WIN64
-    uint16_t utf16_buffer[MAX_RESPONSE_LEN] = {0};
-    wnp_utf8_to_utf16(message_buffer, message_len, utf16_buffer, MAX_RESPONSE_LEN);
-    wprintf(L"%ls\n", utf16_buffer);
+      memset(utf16_buffer, 0, message_cap * sizeof(uint16_t));
+      wnp_utf8_to_utf16(message_buffer, (int)message_len, utf16_buffer, (int)message_cap);
+      wprintf(L"%ls\n", utf16_buffer);
 #else
-    printf("%s\n", message_buffer);
+      printf("%s\n", message_buffer);
 #endif
+    }
     fflush(stdout);
-    free(message_buffer);
-    message_buffer = NULL;
   }
 
-  if (message_buffer != NULL) {
-    free(message_buffer);
-  }
+  free(message_buffer);
+#ifdef _WIN64
+  free(utf16_buffer);
+#endif
 
   // No need to close_fd() the connection here.
   // If the while(true) loop stopped, then either
@@ -475,7 +684,11 @@ static int connect_sock(arguments_t arguments)
 
 int main(int argc, char** argv)
 {
-  arguments_t arguments = parse_args(argc, argv);
+  fields_init();
+  arguments_t arguments;
+  if (!parse_arguments(argc, argv, false, &arguments)) {
+    return EXIT_FAILURE;
+  }
 
   if (arguments.command == COMMAND_START_DAEMON) {
     if (is_daemon_running()) {
@@ -490,7 +703,7 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
       }
 #endif
-      return start_daemon();
+      return start_daemon(&arguments);
     }
   } else {
     return connect_sock(arguments);
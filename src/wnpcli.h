@@ -6,10 +6,12 @@
 #include "wnp.h"
 #include <ctype.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define MAX_RESPONSE_LEN 2048
 #define CLI_PORT 5468
 
 #ifndef WNPCLI_VERSION
@@ -30,7 +32,7 @@
 #include <unistd.h>
 #endif
 
-static char* get_socket_path()
+static inline char* get_socket_path()
 {
   static char socket_path[64] = "";
   static bool initialized = 0;
@@ -74,7 +76,7 @@ static char* get_socket_path()
   return socket_path;
 }
 
-static void close_fd(int fd)
+static inline void close_fd(int fd)
 {
 #ifdef _WIN32
   shutdown(fd, SD_BOTH);
@@ -85,6 +87,27 @@ static void close_fd(int fd)
 #endif
 }
 
+// send and recv can move less than asked for with large messages, these keep going until all of it was.
+static inline bool send_all(int fd, const void* data, size_t len)
+{
+  for (size_t sent = 0; sent < len;) {
+    int result = send(fd, (const char*)data + sent, (int)(len - sent), 0);
+    if (result <= 0) return false;
+    sent += result;
+  }
+  return true;
+}
+
+static inline bool recv_all(int fd, void* data, size_t len)
+{
+  for (size_t received = 0; received < len;) {
+    int result = recv(fd, (char*)data + received, (int)(len - received), 0);
+    if (result <= 0) return false;
+    received += result;
+  }
+  return true;
+}
+
 enum COMMANDS {
   COMMAND_START_DAEMON,
   COMMAND_STOP_DAEMON,
@@ -102,11 +125,16 @@ enum COMMANDS {
   COMMAND_SELECT_ACTIVE,
   COMMAND_SELECT_PREVIOUS,
   COMMAND_SELECT_NEXT,
+  COMMAND_EVENTS,
+  COMMAND_STATS,
+  COMMAND_VIEW,
 };
 
 enum PLAYER_ID {
   PLAYER_ID_ACTIVE = -1,
   PLAYER_ID_SELECTED = -2,
+  PLAYER_ID_QUERY = -3,
+  PLAYER_ID_ALL = -4,
 };
 
 enum METADATA {
@@ -142,6 +170,12 @@ enum METADATA {
   METADATA_ACTIVE_AT,
   METADATA_IS_WEB_BROWSER,
   METADATA_PLATFORM,
+  METADATA_COUNT,
+};
+
+enum SELECT_ORDER {
+  SELECT_ORDER_ID = -1,
+  SELECT_ORDER_RECENT,
 };
 
 enum CLI_FLAGS {
@@ -149,9 +183,22 @@ enum CLI_FLAGS {
   RELATIVE_POSITION_MINUS = (1 << 1),
 };
 
+enum ENCODING {
+  ENCODING_TEXT,
+  ENCODING_JSON,
+  ENCODING_BINARY,
+  ENCODING_COUNT,
+};
+
+#define MAX_NAMED_FORMATS 8
+#define DEFAULT_SCROLL_RATE 4
+#define MAX_SCROLL_RATE 20
+#define VIEW_NAME_LEN 64
+
 typedef struct {
   bool no_detach;
   int player_id;
+  char player_query[256];
   char format[256];
   bool follow;
   bool list_all;
@@ -159,8 +206,21 @@ typedef struct {
   int command;
   int command_arg;
   int flags;
+  int max_rate;
+  int active_debounce;
+  uint32_t on_fields;
+  int named_format_count;
+  char named_formats[MAX_NAMED_FORMATS][256];
+  int encoding;
+  bool delta;
+  int scroll_width;
+  int scroll_rate;
+  char view[VIEW_NAME_LEN];
 } arguments_t;
 
-extern int start_daemon();
+// Parses a command line, or with view the options of a views.conf entry.
+// Errors are printed and make it return false.
+extern bool parse_arguments(int argc, char** argv, bool view, arguments_t* out);
+extern int start_daemon(const arguments_t* arguments);
 
 #endif /* WNPCLI_H */